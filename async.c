@@ -0,0 +1,226 @@
+#include "async.h"
+#include "fs.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <pthread.h>
+
+#define ASYNC_MAX_THREADS 64
+
+#define ASYNC_READ  0
+#define ASYNC_WRITE 1
+
+struct async_request {
+	int op;
+	int inumber;
+	char *data;
+	int length;
+	int offset;
+	fs_callback callback;
+	void *tag;
+	int result;
+	struct async_request *next;
+};
+
+struct async_queue {
+	struct async_request *head;
+	struct async_request *tail;
+};
+
+static pthread_mutex_t async_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t async_submitted = PTHREAD_COND_INITIALIZER;
+static pthread_cond_t async_completed = PTHREAD_COND_INITIALIZER;
+
+static struct async_queue pending;		// Submitted, not yet picked up by a worker
+static struct async_queue completed;		// Finished, not yet collected by the caller
+static int uncollected = 0;			// Requests without a callback whose completion has not been collected
+static int stopping = 0;
+
+static pthread_t workers[ASYNC_MAX_THREADS];
+static int nworkers = 0;
+
+static void queue_push( struct async_queue *q, struct async_request *r )
+{
+	r->next = 0;
+	if(q->tail) q->tail->next = r;
+	else q->head = r;
+	q->tail = r;
+}
+
+static struct async_request *queue_pop( struct async_queue *q )
+{
+	struct async_request *r = q->head;
+	if(r) {
+		q->head = r->next;
+		if(!q->head) q->tail = 0;
+	}
+	return r;
+}
+
+static void *async_worker( void *arg )
+/*
+Carries out queued requests until the pool is stopped and the queue is empty.
+*/
+{
+	struct async_request *r;
+
+	while(1) {
+		pthread_mutex_lock(&async_lock);
+		while(!pending.head && !stopping) pthread_cond_wait(&async_submitted,&async_lock);
+		r = queue_pop(&pending);
+		pthread_mutex_unlock(&async_lock);
+		if(!r) break;
+
+		if(r->op==ASYNC_READ) {
+			r->result = fs_read(r->inumber,r->data,r->length,r->offset);
+		} else {
+			r->result = fs_write(r->inumber,r->data,r->length,r->offset);
+		}
+
+		if(r->callback) {
+			r->callback(r->tag,r->result);
+			free(r);
+		} else {
+			pthread_mutex_lock(&async_lock);
+			queue_push(&completed,r);
+			pthread_cond_signal(&async_completed);
+			pthread_mutex_unlock(&async_lock);
+		}
+	}
+	return 0;
+}
+
+int fs_async_start( int nthreads )
+/*
+Starts a pool of nthreads workers.  Returns one on success and zero on failure, including
+when a pool is already running.
+*/
+{
+	int i;
+
+	if(nworkers>0) {
+		printf("the async pool is already running\n");
+		return 0;
+	}
+	if(nthreads<1 || nthreads>ASYNC_MAX_THREADS) {
+		printf("the async pool needs between 1 and %d threads\n",ASYNC_MAX_THREADS);
+		return 0;
+	}
+
+	stopping = 0;
+	for(i=0;i<nthreads;i++) {
+		if(pthread_create(&workers[i],0,async_worker,0)!=0) {
+			nworkers = i;
+			fs_async_stop();
+			return 0;
+		}
+	}
+	nworkers = nthreads;
+	return 1;
+}
+
+void fs_async_stop()
+/*
+Waits for every submitted request to finish, then stops the pool.  Completions that were
+never collected are discarded.
+*/
+{
+	struct async_request *r;
+	int i;
+
+	pthread_mutex_lock(&async_lock);
+	stopping = 1;
+	pthread_cond_broadcast(&async_submitted);
+	pthread_mutex_unlock(&async_lock);
+
+	for(i=0;i<nworkers;i++) pthread_join(workers[i],0);
+	nworkers = 0;
+
+	while((r=queue_pop(&completed))) free(r);
+	uncollected = 0;
+}
+
+static int async_submit( int op, int inumber, char *data, int length, int offset, fs_callback callback, void *tag )
+{
+	struct async_request *r;
+
+	if(nworkers==0) {
+		printf("the async pool is not running\n");
+		return 0;
+	}
+
+	r = malloc(sizeof(*r));
+	if(!r) return 0;
+	r->op = op;
+	r->inumber = inumber;
+	r->data = data;
+	r->length = length;
+	r->offset = offset;
+	r->callback = callback;
+	r->tag = tag;
+	r->result = 0;
+
+	pthread_mutex_lock(&async_lock);
+	if(!callback) uncollected++;
+	queue_push(&pending,r);
+	pthread_cond_signal(&async_submitted);
+	pthread_mutex_unlock(&async_lock);
+	return 1;
+}
+
+int fs_read_async( int inumber, char *data, int length, int offset, fs_callback callback, void *tag )
+/*
+Queues a read of length bytes at offset into data, which must stay valid until the request
+completes.  Returns one if the request was queued and zero if it was not.
+*/
+{
+	return async_submit(ASYNC_READ,inumber,data,length,offset,callback,tag);
+}
+
+int fs_write_async( int inumber, const char *data, int length, int offset, fs_callback callback, void *tag )
+/*
+Queues a write of length bytes from data at offset.  The data must stay valid and unchanged
+until the request completes.  Returns one if the request was queued and zero if it was not.
+*/
+{
+	return async_submit(ASYNC_WRITE,inumber,(char *)data,length,offset,callback,tag);
+}
+
+static int async_collect( struct fs_completion *done, int max )
+{
+	struct async_request *r;
+	int n = 0;
+
+	while(n<max && (r=queue_pop(&completed))) {
+		done[n].tag = r->tag;
+		done[n].result = r->result;
+		free(r);
+		n++;
+	}
+	uncollected -= n;
+	return n;
+}
+
+int fs_async_poll( struct fs_completion *done, int max )
+/*
+Collects up to max finished requests without waiting.  Returns how many were collected.
+*/
+{
+	pthread_mutex_lock(&async_lock);
+	int n = async_collect(done,max);
+	pthread_mutex_unlock(&async_lock);
+	return n;
+}
+
+int fs_async_wait( struct fs_completion *done, int max )
+/*
+Waits until at least one request has finished, then collects up to max of them.  Returns how
+many were collected, which is zero only if no request without a callback is outstanding.
+*/
+{
+	pthread_mutex_lock(&async_lock);
+	while(!completed.head && uncollected>0 && max>0) pthread_cond_wait(&async_completed,&async_lock);
+	int n = async_collect(done,max);
+	pthread_mutex_unlock(&async_lock);
+	return n;
+}
@@ -0,0 +1,33 @@
+#ifndef ASYNC_H
+#define ASYNC_H
+
+/*
+Asynchronous front end to the filesystem.  Requests are queued and carried out by a pool of
+worker threads through the blocking calls in fs.h, so a single caller can keep many
+operations in flight.  Reads share the filesystem and run in parallel; writes take it
+exclusively.  Requests in flight together may complete in any order, so a caller must not
+issue a write that overlaps another request still outstanding.
+
+A request either names a callback, which runs on a worker thread as soon as the request
+finishes, or passes a null callback and is reported through the completion queue that
+fs_async_poll and fs_async_wait drain.  Either way the result is what the matching blocking
+call would have returned, and the tag given at submission comes back with it.
+*/
+
+struct fs_completion {
+	void *tag;
+	int result;
+};
+
+typedef void (*fs_callback)( void *tag, int result );
+
+int  fs_async_start( int nthreads );
+void fs_async_stop();
+
+int  fs_read_async( int inumber, char *data, int length, int offset, fs_callback callback, void *tag );
+int  fs_write_async( int inumber, const char *data, int length, int offset, fs_callback callback, void *tag );
+
+int  fs_async_poll( struct fs_completion *done, int max );
+int  fs_async_wait( struct fs_completion *done, int max );
+
+#endif
@@ -0,0 +1,183 @@
+/*
+Functional test for the async front end, run by test_io.sh.  Formats the image given on the
+command line (with checksums if -c is given), fills a few files with known contents, one of
+them compressed, then keeps TEST_DEPTH random reads of them in flight through a pool of
+TEST_THREADS workers and checks every one as it completes.  Alongside the reads, writes
+with callbacks keep overwriting the blocks of another file with the same data, never more
+than one at a time to the same block.  Once the pool is stopped, every callback must have
+run, the completion queue must be empty, the written file must read back whole, and fsck
+must find the filesystem clean.  Exits with status 0 if all is well; otherwise the last
+line printed says what went wrong.
+*/
+
+#include "fs.h"
+#include "disk.h"
+#include "async.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+
+#define TEST_NBLOCKS   8000
+#define TEST_FILES     6
+#define TEST_FILE_SIZE (600*DISK_BLOCK_SIZE)
+#define TEST_THREADS   8
+#define TEST_DEPTH     64
+#define TEST_MAX_READ  20000
+#define TEST_READS     20000
+#define TEST_WRITES    2000
+#define TEST_WRITE_BLOCKS 8
+
+static char contents[TEST_FILES][TEST_FILE_SIZE];
+static int inumbers[TEST_FILES];
+
+// One read in flight: which file, where, and the buffer it lands in
+struct test_read {
+	int file;
+	int offset;
+	int length;
+	char data[TEST_MAX_READ];
+};
+
+static struct test_read reads[TEST_DEPTH];
+static char pattern[TEST_WRITE_BLOCKS*DISK_BLOCK_SIZE];
+static int pending[TEST_WRITE_BLOCKS];
+static int callbacks_bad = 0;
+static int callbacks_done = 0;
+
+static void write_done( void *tag, int result )
+{
+	if(result!=DISK_BLOCK_SIZE) __sync_fetch_and_add(&callbacks_bad,1);
+	__sync_fetch_and_add(&callbacks_done,1);
+	__sync_lock_release(&pending[(long)tag]);
+}
+
+static int submit_read( int slot )
+{
+	struct test_read *r = &reads[slot];
+
+	r->file = rand()%TEST_FILES;
+	r->length = 1+rand()%TEST_MAX_READ;
+	r->offset = rand()%(TEST_FILE_SIZE-r->length);
+	return fs_read_async(inumbers[r->file],r->data,r->length,r->offset,0,(void *)(long)slot);
+}
+
+static int populate()
+/*
+Fills every test file with its contents.  The first is random; the second is compressed
+and holds text that compresses well, changing every few thousand bytes.
+*/
+{
+	int f, i;
+
+	for(f=0;f<TEST_FILES;f++) {
+		inumbers[f] = fs_create();
+		if(!inumbers[f]) return 0;
+		if(f==1 && !fs_compress(inumbers[f],1)) return 0;
+		for(i=0;i<TEST_FILE_SIZE;i++) {
+			contents[f][i] = f==1 ? "abc def\n"[i%8]^(i/5000) : rand();
+		}
+		if(fs_write(inumbers[f],contents[f],TEST_FILE_SIZE,0)!=TEST_FILE_SIZE) return 0;
+	}
+	return 1;
+}
+
+int main( int argc, char *argv[] )
+{
+	static char back[sizeof(pattern)];
+	struct fs_completion done[TEST_DEPTH];
+	int features = 0, submitted = 0, finished = 0, writes = 0;
+	int c, i, n, target;
+
+	while((c=getopt(argc,argv,"c"))!=-1) {
+		switch(c) {
+			case 'c': features |= FS_FEATURE_CHECKSUM; break;
+			default:
+				printf("use: %s [-c] <image>\n",argv[0]);
+				return 1;
+		}
+	}
+	if(optind!=argc-1) {
+		printf("use: %s [-c] <image>\n",argv[0]);
+		return 1;
+	}
+
+	srand(7);
+	unlink(argv[optind]);
+	if(!disk_init(argv[optind],TEST_NBLOCKS)) {
+		printf("couldn't initialize %s: %s\n",argv[optind],strerror(errno));
+		return 1;
+	}
+	if(!fs_format_features(features) || !fs_mount() || !populate()) {
+		printf("couldn't set up the test files\n");
+		return 1;
+	}
+	for(i=0;i<(int)sizeof(pattern);i++) pattern[i] = rand();
+	target = fs_create();
+	if(!target || fs_write(target,pattern,sizeof(pattern),0)!=sizeof(pattern)) {
+		printf("couldn't set up the written file\n");
+		return 1;
+	}
+
+	if(!fs_async_start(TEST_THREADS)) {
+		printf("couldn't start the async pool\n");
+		return 1;
+	}
+	for(i=0;i<TEST_DEPTH;i++) {
+		if(!submit_read(i)) {
+			printf("couldn't submit a read\n");
+			return 1;
+		}
+		submitted++;
+	}
+	while(finished<TEST_READS) {
+		n = fs_async_wait(done,TEST_DEPTH);
+		for(i=0;i<n;i++) {
+			int slot = (long)done[i].tag;
+			struct test_read *r = &reads[slot];
+			if(done[i].result!=r->length || memcmp(r->data,contents[r->file]+r->offset,r->length)) {
+				printf("async read of %d bytes at %d in file %d returned the wrong data\n",r->length,r->offset,r->file);
+				return 1;
+			}
+			finished++;
+			if(submitted<TEST_READS) {
+				if(!submit_read(slot)) {
+					printf("couldn't submit a read\n");
+					return 1;
+				}
+				submitted++;
+			}
+			if(writes<TEST_WRITES && rand()%4==0) {
+				int k = rand()%TEST_WRITE_BLOCKS;
+				if(__sync_lock_test_and_set(&pending[k],1)) continue;
+				if(!fs_write_async(target,pattern+k*DISK_BLOCK_SIZE,DISK_BLOCK_SIZE,k*DISK_BLOCK_SIZE,write_done,(void *)(long)k)) {
+					printf("couldn't submit a write\n");
+					return 1;
+				}
+				writes++;
+			}
+		}
+	}
+	fs_async_stop();
+
+	if(callbacks_done!=writes || callbacks_bad) {
+		printf("%d of %d write callbacks ran, %d with the wrong result\n",callbacks_done,writes,callbacks_bad);
+		return 1;
+	}
+	if(fs_async_poll(done,TEST_DEPTH)!=0) {
+		printf("completions were left in the queue\n");
+		return 1;
+	}
+	if(fs_read(target,back,sizeof(back),0)!=sizeof(back) || memcmp(back,pattern,sizeof(back))) {
+		printf("the file written through callbacks reads back wrong\n");
+		return 1;
+	}
+	if(fs_fsck(0)!=0) {
+		printf("fsck found problems after the async run\n");
+		return 1;
+	}
+	disk_close();
+	return 0;
+}
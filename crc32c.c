@@ -0,0 +1,278 @@
+#include "crc32c.h"
+
+#include <string.h>
+#include <pthread.h>
+
+#define CRC32C_POLY 0x82f63b78
+
+static uint32_t table[8][256];
+
+static void crc32c_init_table()
+{
+	uint32_t i, j, crc;
+
+	for(i=0;i<256;i++) {
+		crc = i;
+		for(j=0;j<8;j++) {
+			crc = crc&1 ? (crc>>1)^CRC32C_POLY : crc>>1;
+		}
+		table[0][i] = crc;
+	}
+	for(i=0;i<256;i++) {
+		crc = table[0][i];
+		for(j=1;j<8;j++) {
+			crc = table[0][crc&0xff] ^ (crc>>8);
+			table[j][i] = crc;
+		}
+	}
+}
+
+static uint32_t crc32c_sw( uint32_t crc, const unsigned char *p, size_t length )
+{
+	while(length && ((uintptr_t)p&7)) {
+		crc = table[0][(crc^*p++)&0xff] ^ (crc>>8);
+		length--;
+	}
+	while(length>=8) {
+		uint64_t word;
+		memcpy(&word,p,8);
+		word ^= crc;
+		crc = table[7][word&0xff] ^
+		      table[6][(word>>8)&0xff] ^
+		      table[5][(word>>16)&0xff] ^
+		      table[4][(word>>24)&0xff] ^
+		      table[3][(word>>32)&0xff] ^
+		      table[2][(word>>40)&0xff] ^
+		      table[1][(word>>48)&0xff] ^
+		      table[0][word>>56];
+		p += 8;
+		length -= 8;
+	}
+	while(length--) {
+		crc = table[0][(crc^*p++)&0xff] ^ (crc>>8);
+	}
+	return crc;
+}
+
+#if defined(__x86_64__)
+
+#include <immintrin.h>
+
+// Stripe length for the three-way interleaved kernel; three stripes cover 4080 bytes of a block
+#define CRC32C_STRIPE 1360
+
+static uint32_t shift_table[4][256];
+
+static void crc32c_init_shift()
+/*
+Builds tables for the linear map that advances a raw CRC register over CRC32C_STRIPE zero
+bytes, so that independently computed stripes can be stitched back together.
+*/
+{
+	static const unsigned char zeros[CRC32C_STRIPE];
+	uint32_t basis[32];
+	int i, j, k;
+
+	for(i=0;i<32;i++) {
+		basis[i] = crc32c_sw(1u<<i,zeros,sizeof(zeros));
+	}
+	for(k=0;k<4;k++) {
+		for(j=0;j<256;j++) {
+			uint32_t v = 0;
+			for(i=0;i<8;i++) {
+				if(j&(1<<i)) v ^= basis[k*8+i];
+			}
+			shift_table[k][j] = v;
+		}
+	}
+}
+
+static uint32_t crc32c_shift( uint32_t crc )
+{
+	return shift_table[0][crc&0xff] ^ shift_table[1][(crc>>8)&0xff] ^
+	       shift_table[2][(crc>>16)&0xff] ^ shift_table[3][crc>>24];
+}
+
+__attribute__((target("sse4.2")))
+static uint32_t crc32c_hw( uint32_t crc, const unsigned char *p, size_t length )
+{
+	uint64_t c = crc;
+
+	while(length && ((uintptr_t)p&7)) {
+		c = _mm_crc32_u8(c,*p++);
+		length--;
+	}
+	// Three independent stripes keep the crc32 unit busy despite its three cycle latency
+	while(length>=3*CRC32C_STRIPE) {
+		uint64_t c1 = 0, c2 = 0;
+		const unsigned char *p1 = p + CRC32C_STRIPE;
+		const unsigned char *p2 = p + 2*CRC32C_STRIPE;
+		size_t i;
+		for(i=0;i<CRC32C_STRIPE;i+=8) {
+			uint64_t a, b, d;
+			memcpy(&a,p+i,8);
+			memcpy(&b,p1+i,8);
+			memcpy(&d,p2+i,8);
+			c = _mm_crc32_u64(c,a);
+			c1 = _mm_crc32_u64(c1,b);
+			c2 = _mm_crc32_u64(c2,d);
+		}
+		c = crc32c_shift(crc32c_shift(c) ^ c1) ^ c2;
+		p += 3*CRC32C_STRIPE;
+		length -= 3*CRC32C_STRIPE;
+	}
+	while(length>=8) {
+		uint64_t a;
+		memcpy(&a,p,8);
+		c = _mm_crc32_u64(c,a);
+		p += 8;
+		length -= 8;
+	}
+	while(length--) {
+		c = _mm_crc32_u8(c,*p++);
+	}
+	return c;
+}
+
+/*
+Folding constants for the carry-less multiply kernel, in _mm_set_epi64x order.  Each pair
+moves a 128-bit chunk of the message forward by d bits: the second multiplies its leading
+(higher degree) low quadword and is x^(d+31) mod P, the first multiplies the high quadword
+and is x^(d-33) mod P, both bit-reflected.  The product's place in the register supplies the
+missing x^33.
+*/
+#define FOLD_2048 0xb9e02b86, 0xdcb17aa4
+#define FOLD_1536 0xab7aff2a, 0xa87ab8a8
+#define FOLD_1024 0x0d3b6092, 0x6992cea2
+#define FOLD_512  0x9e4addf8, 0x740eef02
+#define FOLD_384  0xddc0152b, 0x1c291d04
+#define FOLD_256  0xba4fc28e, 0x3da6d0cb
+#define FOLD_128  0x493c7d27, 0xf20c0dfe
+
+__attribute__((target("sse4.2,pclmul")))
+static __m128i crc32c_fold128( __m128i x, __m128i k )
+{
+	return _mm_xor_si128(_mm_clmulepi64_si128(x,k,0x00),_mm_clmulepi64_si128(x,k,0x11));
+}
+
+__attribute__((target("sse4.2,pclmul,avx512f,vpclmulqdq")))
+static uint32_t crc32c_clmul( uint32_t crc, const unsigned char *p, size_t length )
+/*
+Folds the message 256 bytes at a time in four 512-bit registers, each chunk multiplied
+forward onto the one 256 bytes later, then folds the first three registers onto the last
+side by side and its 128-bit lanes into one.  That 128-bit remainder is congruent to
+everything before it, so the crc32 instruction over its 16 bytes and the tail finishes the
+job.  length must be at least 256.
+*/
+{
+	const __m512i k2048 = _mm512_set_epi64(FOLD_2048,FOLD_2048,FOLD_2048,FOLD_2048);
+	const __m512i k[3] = {
+		_mm512_set_epi64(FOLD_1536,FOLD_1536,FOLD_1536,FOLD_1536),
+		_mm512_set_epi64(FOLD_1024,FOLD_1024,FOLD_1024,FOLD_1024),
+		_mm512_set_epi64(FOLD_512,FOLD_512,FOLD_512,FOLD_512),
+	};
+	const __m512i lanes = _mm512_set_epi64(0,0,FOLD_128,FOLD_256,FOLD_384);
+	__m512i x[4], z, f;
+	__m128i y;
+	uint64_t c;
+	int i;
+
+	for(i=0;i<4;i++) x[i] = _mm512_loadu_si512(p+64*i);
+	x[0] = _mm512_xor_si512(x[0],_mm512_castsi128_si512(_mm_cvtsi32_si128(crc)));
+	p += 256;
+	length -= 256;
+
+	while(length>=256) {
+		for(i=0;i<4;i++) {
+			x[i] = _mm512_ternarylogic_epi64(_mm512_clmulepi64_epi128(x[i],k2048,0x00),
+			                                 _mm512_clmulepi64_epi128(x[i],k2048,0x11),
+			                                 _mm512_loadu_si512(p+64*i),0x96);
+		}
+		p += 256;
+		length -= 256;
+	}
+	for(i=0;i<3;i++) {
+		x[i] = _mm512_xor_si512(_mm512_clmulepi64_epi128(x[i],k[i],0x00),_mm512_clmulepi64_epi128(x[i],k[i],0x11));
+	}
+	z = _mm512_ternarylogic_epi64(x[0],x[1],_mm512_xor_si512(x[2],x[3]),0x96);
+
+	// Fold the first three lanes onto the last, each from its own distance
+	f = _mm512_xor_si512(_mm512_clmulepi64_epi128(z,lanes,0x00),_mm512_clmulepi64_epi128(z,lanes,0x11));
+	y = _mm_xor_si128(_mm512_extracti32x4_epi32(f,0),_mm512_extracti32x4_epi32(f,1));
+	y = _mm_xor_si128(y,_mm_xor_si128(_mm512_extracti32x4_epi32(f,2),_mm512_extracti32x4_epi32(z,3)));
+
+	while(length>=16) {
+		y = _mm_xor_si128(crc32c_fold128(y,_mm_set_epi64x(FOLD_128)),_mm_loadu_si128((const __m128i *)p));
+		p += 16;
+		length -= 16;
+	}
+	c = _mm_crc32_u64(0,_mm_cvtsi128_si64(y));
+	c = _mm_crc32_u64(c,_mm_extract_epi64(y,1));
+	return crc32c_hw(c,p,length);
+}
+
+static int have_hw = 0;
+static int have_clmul = 0;
+
+static void crc32c_init_cpu()
+/*
+Picks the kernels this CPU can run and builds the shift tables the crc32 kernel needs.
+*/
+{
+	have_hw = __builtin_cpu_supports("sse4.2");
+	have_clmul = have_hw && __builtin_cpu_supports("avx512f") && __builtin_cpu_supports("vpclmulqdq");
+	if(have_hw) crc32c_init_shift();
+}
+
+#else
+
+static uint32_t crc32c_hw( uint32_t crc, const unsigned char *p, size_t length )
+{
+	return crc32c_sw(crc,p,length);
+}
+
+static uint32_t crc32c_clmul( uint32_t crc, const unsigned char *p, size_t length )
+{
+	return crc32c_sw(crc,p,length);
+}
+
+static const int have_hw = 0;
+static const int have_clmul = 0;
+
+static void crc32c_init_cpu()
+{
+}
+
+#endif
+
+static pthread_once_t init_once = PTHREAD_ONCE_INIT;
+
+static void crc32c_init()
+/*
+Builds every table and picks the kernels exactly once, before the first checksum, however
+many threads ask for one at the same time.
+*/
+{
+	crc32c_init_table();
+	crc32c_init_cpu();
+}
+
+uint32_t crc32c( uint32_t crc, const void *data, size_t length )
+{
+	pthread_once(&init_once,crc32c_init);
+	crc = ~crc;
+	if(length>=256 && have_clmul) {
+		crc = crc32c_clmul(crc,data,length);
+	} else if(have_hw) {
+		crc = crc32c_hw(crc,data,length);
+	} else {
+		crc = crc32c_sw(crc,data,length);
+	}
+	return ~crc;
+}
+
+const char *crc32c_implementation()
+{
+	pthread_once(&init_once,crc32c_init);
+	return have_clmul ? "vpclmulqdq" : have_hw ? "sse4.2" : "software";
+}
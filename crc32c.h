@@ -0,0 +1,17 @@
+#ifndef CRC32C_H
+#define CRC32C_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+/*
+CRC32C (Castagnoli) checksums.  Folds buffers of 256 bytes or more with AVX-512 carry-less
+multiplies when the CPU has VPCLMULQDQ, uses the SSE4.2 crc32 instruction otherwise when it
+has that, and a slicing-by-8 table on anything else.  The tables are built on the first
+call, once, so any number of threads may call crc32c() at the same time.
+*/
+
+uint32_t crc32c( uint32_t crc, const void *data, size_t length );
+const char *crc32c_implementation();
+
+#endif
@@ -4,36 +4,320 @@
 #include <unistd.h>
 #include <errno.h>
 #include <string.h>
+#include <time.h>
+#include <pthread.h>
+#include <fcntl.h>
+#include <sys/uio.h>
 
 #include "disk.h"
+#include "stats.h"
+#include "trace.h"
 
 #define DISK_MAGIC 0xdeadbeef
+#define DISK_MAX_RUN 64
+#define DISK_MAX_MEMBERS 16
+#define DISK_STRIPE_UNIT 16		// Default stripe unit, in blocks
 
-static FILE *diskfile;
+static int member_fd[DISK_MAX_MEMBERS];
+static int nmembers=0;
+static int stripe_unit=DISK_STRIPE_UNIT;
 static int nblocks=0;
 static int nreads=0;
 static int nwrites=0;
 
+// Presets for disk_model_set(); "none" turns the model off
+static const struct disk_model model_hdd = { 500, 0.01, 12000, 4167, 150, 0, 0 };
+static const struct disk_model model_ssd = { 0, 0, 0, 0, 500, 25, 60 };
+
+static int model_enabled=0;
+static struct disk_model model;
+static long long model_ns=0;
+static long long model_seeks=0;
+static int model_head=-1;
+
+static FILE *tracefile=0;
+static long long trace_start_ns=0;
+static pthread_mutex_t trace_lock = PTHREAD_MUTEX_INITIALIZER;
+static __thread int trace_caller = TRACE_CALLER_NONE;
+
+// Each member of a striped disk has an I/O thread working through its own queue of jobs
+struct member_job {
+	int write;
+	int n;
+	int *blocknums;
+	char **data;
+	int *pending;
+	struct member_job *next;
+};
+
+struct member_queue {
+	pthread_mutex_t lock;
+	pthread_cond_t ready;
+	struct member_job *head;
+	struct member_job *tail;
+	pthread_t thread;
+	int stop;
+};
+
+static struct member_queue queues[DISK_MAX_MEMBERS];
+static pthread_mutex_t jobs_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t jobs_done = PTHREAD_COND_INITIALIZER;
+
+static int member_of( int blocknum, int *memberblock );
+static void *member_thread( void *arg );
+static void members_close();
+
 int disk_init( const char *filename, int n )
+/*
+Opens the disk image, creating it if needed, and sizes it to n blocks.  The filename may
+instead be a comma separated list of images, which are striped together into one disk of
+n blocks: consecutive runs of SIMPLEFS_STRIPE_UNIT blocks (16 unless set) go to each image
+in turn, and each image is served by its own I/O thread.
+*/
 {
-	diskfile = fopen(filename,"r+");
-	if(!diskfile) diskfile = fopen(filename,"w+");
-	if(!diskfile) return 0;
+	const char *spec = getenv("SIMPLEFS_DISK_MODEL");
+	const char *unit = getenv("SIMPLEFS_STRIPE_UNIT");
+	char buffer[4096];
+	char *item, *save;
+	int i;
+
+	if(spec && !disk_model_set(spec)) {
+		printf("ERROR: invalid SIMPLEFS_DISK_MODEL: %s\n",spec);
+		errno = EINVAL;
+		return 0;
+	}
+
+	stripe_unit = unit ? atoi(unit) : DISK_STRIPE_UNIT;
+	if(stripe_unit<1) {
+		printf("ERROR: invalid SIMPLEFS_STRIPE_UNIT: %s\n",unit);
+		errno = EINVAL;
+		return 0;
+	}
+
+	if(strlen(filename)>=sizeof(buffer)) {
+		errno = ENAMETOOLONG;
+		return 0;
+	}
+	strcpy(buffer,filename);
+
+	members_close();
+	for(item=strtok_r(buffer,",",&save);item;item=strtok_r(0,",",&save)) {
+		if(nmembers==DISK_MAX_MEMBERS) {
+			printf("ERROR: a disk can be striped over at most %d images\n",DISK_MAX_MEMBERS);
+			members_close();
+			errno = EINVAL;
+			return 0;
+		}
+		member_fd[nmembers] = open(item,O_RDWR|O_CREAT,0666);
+		if(member_fd[nmembers]<0) {
+			members_close();
+			return 0;
+		}
+		nmembers++;
+	}
+	if(nmembers==0) {
+		errno = ENOENT;
+		return 0;
+	}
 
-	ftruncate(fileno(diskfile),n*DISK_BLOCK_SIZE);
+	// Each image holds every nmembers'th stripe, starting from its position in the list
+	for(i=0;i<nmembers;i++) {
+		long long stripes = ((long long)n+stripe_unit-1)/stripe_unit;
+		long long size = nmembers==1 ? n : (stripes-i+nmembers-1)/nmembers*stripe_unit;
+		ftruncate(member_fd[i],(off_t)size*DISK_BLOCK_SIZE);
+	}
+
+	for(i=0;nmembers>1 && i<nmembers;i++) {
+		struct member_queue *q = &queues[i];
+		pthread_mutex_init(&q->lock,0);
+		pthread_cond_init(&q->ready,0);
+		q->head = q->tail = 0;
+		q->stop = 0;
+		if(pthread_create(&q->thread,0,member_thread,q)!=0) {
+			nmembers = i;
+			members_close();
+			return 0;
+		}
+	}
 
 	nblocks = n;
 	nreads = 0;
 	nwrites = 0;
+	model_ns = 0;
+	model_seeks = 0;
+	model_head = -1;
 
 	return 1;
 }
 
+static void members_close()
+/*
+Stops the member I/O threads, if there are any, and closes every image.
+*/
+{
+	int i;
+
+	for(i=0;nmembers>1 && i<nmembers;i++) {
+		struct member_queue *q = &queues[i];
+		pthread_mutex_lock(&q->lock);
+		q->stop = 1;
+		pthread_cond_signal(&q->ready);
+		pthread_mutex_unlock(&q->lock);
+		pthread_join(q->thread,0);
+	}
+	for(i=0;i<nmembers;i++) close(member_fd[i]);
+	nmembers = 0;
+}
+
+int disk_model_set( const char *spec )
+/*
+Configures the device model from a comma separated list.  The list may start with a
+preset, "hdd", "ssd" or "none", followed by field=value overrides, for example
+"hdd,rotation_us=2000" or "ssd,write_us=100".  Returns one on success, zero if the
+specification could not be parsed, in which case the model is left unchanged.
+*/
+{
+	struct disk_model m;
+	int enabled = 1;
+	char buffer[1024];
+	char *item, *save;
+
+	memset(&m,0,sizeof(m));
+	if(strlen(spec)>=sizeof(buffer)) return 0;
+	strcpy(buffer,spec);
+
+	for(item=strtok_r(buffer,",",&save);item;item=strtok_r(0,",",&save)) {
+		char *value = strchr(item,'=');
+		double *field = 0;
+
+		if(!value) {
+			if(!strcmp(item,"hdd")) m = model_hdd;
+			else if(!strcmp(item,"ssd")) m = model_ssd;
+			else if(!strcmp(item,"none")) enabled = 0;
+			else return 0;
+			continue;
+		}
+
+		*value++ = 0;
+		if(!strcmp(item,"seek_min_us")) field = &m.seek_min_us;
+		else if(!strcmp(item,"seek_per_block_us")) field = &m.seek_per_block_us;
+		else if(!strcmp(item,"seek_max_us")) field = &m.seek_max_us;
+		else if(!strcmp(item,"rotation_us")) field = &m.rotation_us;
+		else if(!strcmp(item,"transfer_MBps")) field = &m.transfer_MBps;
+		else if(!strcmp(item,"read_us")) field = &m.read_us;
+		else if(!strcmp(item,"write_us")) field = &m.write_us;
+		else return 0;
+
+		char *end;
+		*field = strtod(value,&end);
+		if(end==value || *end || *field<0) return 0;
+	}
+
+	model = m;
+	model_enabled = enabled;
+	return 1;
+}
+
+long long disk_model_time_ns()
+{
+	return model_ns;
+}
+
+static void model_account( int blocknum, int write )
+{
+	double us = write ? model.write_us : model.read_us;
+	int head = __sync_lock_test_and_set(&model_head,blocknum);
+
+	if(head<0 || blocknum!=head+1) {
+		double seek = model.seek_min_us + model.seek_per_block_us*abs(blocknum-head);
+		if(model.seek_max_us>0 && seek>model.seek_max_us) seek = model.seek_max_us;
+		us += seek + model.rotation_us;
+		if(seek>0) __sync_fetch_and_add(&model_seeks,1);
+	}
+	if(model.transfer_MBps>0) {
+		us += DISK_BLOCK_SIZE / model.transfer_MBps;
+	}
+
+	__sync_fetch_and_add(&model_ns,(long long)(us*1000));
+}
+
 int disk_size()
 {
 	return nblocks;
 }
 
+static long long trace_now()
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC,&ts);
+	return (long long)ts.tv_sec*1000000000LL + ts.tv_nsec;
+}
+
+int disk_trace_start( const char *filename )
+{
+	struct trace_header header;
+	FILE *file;
+
+	if(tracefile) disk_trace_stop();
+
+	file = fopen(filename,"w");
+	if(!file) return 0;
+
+	memset(&header,0,sizeof(header));
+	memcpy(header.magic,TRACE_MAGIC,sizeof(header.magic));
+	header.version = TRACE_VERSION;
+	header.nblocks = nblocks;
+
+	if(fwrite(&header,sizeof(header),1,file)!=1) {
+		fclose(file);
+		return 0;
+	}
+
+	pthread_mutex_lock(&trace_lock);
+	trace_start_ns = trace_now();
+	tracefile = file;
+	pthread_mutex_unlock(&trace_lock);
+
+	return 1;
+}
+
+void disk_trace_stop()
+{
+	pthread_mutex_lock(&trace_lock);
+	if(tracefile) {
+		fclose(tracefile);
+		tracefile = 0;
+	}
+	pthread_mutex_unlock(&trace_lock);
+}
+
+int disk_trace_caller( int caller )
+{
+	int old = trace_caller;
+	trace_caller = caller;
+	return old;
+}
+
+static void trace_record( int blocknum, int op )
+{
+	struct trace_record r;
+
+	pthread_mutex_lock(&trace_lock);
+	if(tracefile) {
+		r.timestamp_ns = trace_now() - trace_start_ns;
+		r.blocknum = blocknum;
+		r.op = op;
+		r.caller = trace_caller;
+		r.reserved = 0;
+		if(fwrite(&r,sizeof(r),1,tracefile)!=1) {
+			printf("ERROR: couldn't write trace record: %s\n",strerror(errno));
+			fclose(tracefile);
+			tracefile = 0;
+		}
+	}
+	pthread_mutex_unlock(&trace_lock);
+}
+
 static void sanity_check( int blocknum, const void *data )
 {
 	if(blocknum<0) {
@@ -54,38 +338,227 @@ static void sanity_check( int blocknum, const void *data )
 
 void disk_read( int blocknum, char *data )
 {
-	sanity_check(blocknum,data);
+	struct stats_timer t;
 
-	fseek(diskfile,blocknum*DISK_BLOCK_SIZE,SEEK_SET);
+	sanity_check(blocknum,data);
+	stats_begin(&t);
 
-	if(fread(data,DISK_BLOCK_SIZE,1,diskfile)==1) {
-		nreads++;
+	int memberblock, member = member_of(blocknum,&memberblock);
+	if(pread(member_fd[member],data,DISK_BLOCK_SIZE,(off_t)memberblock*DISK_BLOCK_SIZE)==DISK_BLOCK_SIZE) {
+		__sync_fetch_and_add(&nreads,1);
 	} else {
 		printf("ERROR: couldn't access simulated disk: %s\n",strerror(errno));
 		abort();
 	}
+
+	stats_end(&t,STATS_DISK_READ,DISK_BLOCK_SIZE);
+	if(model_enabled) model_account(blocknum,0);
+	if(tracefile) trace_record(blocknum,TRACE_OP_READ);
 }
 
 void disk_write( int blocknum, const char *data )
 {
-	sanity_check(blocknum,data);
+	struct stats_timer t;
 
-	fseek(diskfile,blocknum*DISK_BLOCK_SIZE,SEEK_SET);
+	sanity_check(blocknum,data);
+	stats_begin(&t);
 
-	if(fwrite(data,DISK_BLOCK_SIZE,1,diskfile)==1) {
-		nwrites++;
+	int memberblock, member = member_of(blocknum,&memberblock);
+	if(pwrite(member_fd[member],data,DISK_BLOCK_SIZE,(off_t)memberblock*DISK_BLOCK_SIZE)==DISK_BLOCK_SIZE) {
+		__sync_fetch_and_add(&nwrites,1);
 	} else {
 		printf("ERROR: couldn't access simulated disk: %s\n",strerror(errno));
 		abort();
 	}
+
+	stats_end(&t,STATS_DISK_WRITE,DISK_BLOCK_SIZE);
+	if(model_enabled) model_account(blocknum,1);
+	if(tracefile) trace_record(blocknum,TRACE_OP_WRITE);
+}
+
+static int member_of( int blocknum, int *memberblock )
+/*
+Returns which image of a striped disk holds blocknum, and where in that image it is.
+*/
+{
+	int stripe = blocknum/stripe_unit;
+	*memberblock = stripe/nmembers*stripe_unit + blocknum%stripe_unit;
+	return stripe%nmembers;
+}
+
+static void member_transfer( int member, const int *blocknums, char *const *data, int n, int write )
+/*
+Moves n blocks to or from one image, each to or from its own buffer.  Each run of
+consecutive block numbers goes to the host file as one preadv or pwritev of up to
+DISK_MAX_RUN blocks.
+*/
+{
+	struct iovec iov[DISK_MAX_RUN];
+	int i, j, k;
+
+	for(i=0;i<n;i=j) {
+		j = i+1;
+		while(j<n && j-i<DISK_MAX_RUN && blocknums[j]==blocknums[j-1]+1) j++;
+		for(k=i;k<j;k++) {
+			iov[k-i].iov_base = data[k];
+			iov[k-i].iov_len = DISK_BLOCK_SIZE;
+		}
+
+		ssize_t length = (ssize_t)(j-i)*DISK_BLOCK_SIZE;
+		off_t offset = (off_t)blocknums[i]*DISK_BLOCK_SIZE;
+		ssize_t actual = write ? pwritev(member_fd[member],iov,j-i,offset) : preadv(member_fd[member],iov,j-i,offset);
+		if(actual!=length) {
+			printf("ERROR: couldn't access simulated disk: %s\n",strerror(errno));
+			abort();
+		}
+	}
+}
+
+static void *member_thread( void *arg )
+{
+	struct member_queue *q = arg;
+	struct member_job *job;
+
+	while(1) {
+		pthread_mutex_lock(&q->lock);
+		while(!q->head && !q->stop) pthread_cond_wait(&q->ready,&q->lock);
+		job = q->head;
+		if(job) {
+			q->head = job->next;
+			if(!q->head) q->tail = 0;
+		}
+		pthread_mutex_unlock(&q->lock);
+		if(!job) break;
+
+		member_transfer(q-queues,job->blocknums,job->data,job->n,job->write);
+
+		pthread_mutex_lock(&jobs_lock);
+		(*job->pending)--;
+		pthread_cond_broadcast(&jobs_done);
+		pthread_mutex_unlock(&jobs_lock);
+	}
+	return 0;
+}
+
+static void striped_transfer( const int *blocknums, char *const *data, int n, int write )
+/*
+Splits a transfer by image, keeping each image's blocks in order, and hands every image's
+share to its I/O thread so that all the images work at once.  A transfer that falls on a
+single image is done directly.
+*/
+{
+	struct member_job jobs[DISK_MAX_MEMBERS];
+	int count[DISK_MAX_MEMBERS];
+	int start[DISK_MAX_MEMBERS];
+	int *memberblocks = malloc(sizeof(int)*n);
+	char **memberdata = malloc(sizeof(char *)*n);
+	int i, m, busy = 0, pending = 0;
+
+	if(!memberblocks || !memberdata) {
+		printf("ERROR: out of memory for a disk transfer\n");
+		abort();
+	}
+
+	memset(count,0,sizeof(count));
+	for(i=0;i<n;i++) {
+		int memberblock;
+		count[member_of(blocknums[i],&memberblock)]++;
+	}
+	for(m=0,i=0;m<nmembers;m++) {
+		start[m] = i;
+		i += count[m];
+		if(count[m]>0) busy++;
+	}
+	for(i=0;i<n;i++) {
+		int memberblock;
+		m = member_of(blocknums[i],&memberblock);
+		memberblocks[start[m]] = memberblock;
+		memberdata[start[m]] = data[i];
+		start[m]++;
+	}
+	for(m=0;m<nmembers;m++) start[m] -= count[m];
+
+	for(m=0;m<nmembers;m++) {
+		if(count[m]==0) continue;
+		if(busy==1) {
+			member_transfer(m,memberblocks+start[m],memberdata+start[m],count[m],write);
+			break;
+		}
+
+		struct member_queue *q = &queues[m];
+		jobs[m].write = write;
+		jobs[m].n = count[m];
+		jobs[m].blocknums = memberblocks+start[m];
+		jobs[m].data = memberdata+start[m];
+		jobs[m].pending = &pending;
+		jobs[m].next = 0;
+
+		pthread_mutex_lock(&jobs_lock);
+		pending++;
+		pthread_mutex_unlock(&jobs_lock);
+
+		pthread_mutex_lock(&q->lock);
+		if(q->tail) q->tail->next = &jobs[m];
+		else q->head = &jobs[m];
+		q->tail = &jobs[m];
+		pthread_cond_signal(&q->ready);
+		pthread_mutex_unlock(&q->lock);
+	}
+
+	pthread_mutex_lock(&jobs_lock);
+	while(pending>0) pthread_cond_wait(&jobs_done,&jobs_lock);
+	pthread_mutex_unlock(&jobs_lock);
+
+	free(memberblocks);
+	free(memberdata);
+}
+
+static void disk_transfer( const int *blocknums, char *const *data, int n, int write )
+/*
+Moves n blocks, each to or from its own buffer, in a single call to the disk.  Every block
+still counts as one read or write in the totals, the device model and the trace.
+*/
+{
+	struct stats_timer t;
+	int i;
+
+	if(n<=0) return;
+	for(i=0;i<n;i++) sanity_check(blocknums[i],data[i]);
+
+	stats_begin(&t);
+	if(nmembers==1) {
+		member_transfer(0,blocknums,data,n,write);
+	} else {
+		striped_transfer(blocknums,data,n,write);
+	}
+	__sync_fetch_and_add(write ? &nwrites : &nreads,n);
+	stats_end(&t,write ? STATS_DISK_WRITE : STATS_DISK_READ,(long long)n*DISK_BLOCK_SIZE);
+
+	for(i=0;i<n;i++) {
+		if(model_enabled) model_account(blocknums[i],write);
+		if(tracefile) trace_record(blocknums[i],write ? TRACE_OP_WRITE : TRACE_OP_READ);
+	}
+}
+
+void disk_readv( const int *blocknums, char *const *data, int n )
+{
+	disk_transfer(blocknums,data,n,0);
+}
+
+void disk_writev( const int *blocknums, const char *const *data, int n )
+{
+	disk_transfer(blocknums,(char *const *)data,n,1);
 }
 
 void disk_close()
 {
-	if(diskfile) {
+	disk_trace_stop();
+	if(nmembers>0) {
 		printf("%d disk block reads\n",nreads);
 		printf("%d disk block writes\n",nwrites);
-		fclose(diskfile);
-		diskfile = 0;
+		if(model_enabled) {
+			printf("%.3f ms simulated service time (%lld seeks)\n",model_ns/1e6,model_seeks);
+		}
+		members_close();
 	}
 }
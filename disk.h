@@ -3,11 +3,43 @@
 
 #define DISK_BLOCK_SIZE 4096
 
+/*
+The disk is a single image file, or several striped together when disk_init is given a
+comma separated list of them.  Striping puts each run of SIMPLEFS_STRIPE_UNIT blocks
+(16 by default) on the next image in turn, and a vectored transfer touching several
+images has each one served by its own I/O thread at the same time.
+*/
 int  disk_init( const char *filename, int nblocks );
 int  disk_size();
 void disk_read( int blocknum, char *data );
 void disk_write( int blocknum, const char *data );
+void disk_readv( const int *blocknums, char *const *data, int n );
+void disk_writev( const int *blocknums, const char *const *data, int n );
 void disk_close();
 
+/*
+Optional device model.  When enabled, every transfer adds its simulated service time to an
+accumulator reported by disk_close(), so layout changes can be judged by how they would
+behave on real media.  A transfer to the block after the previous one costs only its
+transfer time; any other block also pays a seek proportional to the distance, capped at
+seek_max_us, plus the average rotational latency.  All times are in microseconds.
+*/
+struct disk_model {
+	double seek_min_us;		// Settle time of the shortest seek
+	double seek_per_block_us;	// Additional seek time per block of distance
+	double seek_max_us;		// Full-stroke seek time
+	double rotation_us;		// Average rotational latency
+	double transfer_MBps;		// Media transfer rate
+	double read_us;			// Fixed per-read overhead
+	double write_us;		// Fixed per-write overhead
+};
+
+int  disk_model_set( const char *spec );
+long long disk_model_time_ns();
+
+int  disk_trace_start( const char *filename );
+void disk_trace_stop();
+int  disk_trace_caller( int caller );
+
 
 #endif
\ No newline at end of file
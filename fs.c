@@ -1,6 +1,10 @@
 
 #include "fs.h"
 #include "disk.h"
+#include "stats.h"
+#include "trace.h"
+#include "crc32c.h"
+#include "lz.h"
 
 #include <stdio.h>
 #include <string.h>
@@ -8,22 +12,74 @@
 #include <errno.h>
 #include <unistd.h>
 #include <math.h>
+#include <pthread.h>
+#include <limits.h>
+#include <stdarg.h>
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
 
 #define FS_MAGIC           0xf0f03410
 #define INODES_PER_BLOCK   128
 #define POINTERS_PER_INODE 5
 #define POINTERS_PER_BLOCK 1024
+#define CHECKSUMS_PER_BLOCK (DISK_BLOCK_SIZE / sizeof(unsigned int))
+#define ENTRIES_PER_BLOCK  (DISK_BLOCK_SIZE / sizeof(unsigned int))
+#define FS_MAX_FILE_SIZE   ((POINTERS_PER_INODE + POINTERS_PER_BLOCK) * DISK_BLOCK_SIZE)
 #define NELEMS(x)  (sizeof(x) / sizeof((x)[0]))
 
+// Values of the isvalid field.  A compressed file keeps its data in compressed clusters.
+// The root directory's table and buckets are marked as directory inodes, which only the
+// directory calls may change.
+#define INODE_VALID        1
+#define INODE_COMPRESSED   2
+#define INODE_DIRECTORY    4
+
+// Compressed files are stored a cluster of logical blocks at a time.  A cluster that shrinks
+// keeps its compressed stream in the first slots of its block map and marks the rest.
+#define CLUSTER_BLOCKS     8
+#define CLUSTER_SIZE       (CLUSTER_BLOCKS * DISK_BLOCK_SIZE)
+#define BLOCK_COMPRESSED   (-1)
+
+// Every call in fs.h holds this while it runs.  Reads share it, so reads of different
+// files can proceed in parallel; everything else takes it exclusively.
+static pthread_rwlock_t FS_LOCK = PTHREAD_RWLOCK_INITIALIZER;
+
+// Guards the cluster cache when compressed files are read in parallel
+static pthread_mutex_t CLUSTER_LOCK = PTHREAD_MUTEX_INITIALIZER;
+
+// INODE_BITMAP holds one for an inode in use, or DIRECTORY_INODE for one of the root
+// directory's own inodes
+#define DIRECTORY_INODE    2
+
 int IS_MOUNTED = 0;
-int *BLOCK_BITMAP;
+
+// Free block map: one bit per block, set while the block is in use
+unsigned long long *BLOCK_BITMAP;
 int *INODE_BITMAP;
 
+// Every data block below this one is in use, so the search for a free block starts here
+int FREE_HINT;
+
+// Free-inode index kept next to INODE_BITMAP: one bit per inode, set while the inode is
+// free, and one summary bit per word of it that still has a free inode
+unsigned long long *INODE_FREE;
+unsigned long long *INODE_FREE_SUMMARY;
+int INODE_FREE_WORDS;
+
 struct fs_superblock {
 	int magic;
 	int nblocks;
 	int ninodeblocks;
 	int ninodes;
+	int features;			// FS_FEATURE_* bits; zero on filesystems that predate them
+	int checksum_start;		// First block of the checksum table
+	int nchecksumblocks;
+	int refcount_start;		// First block of the reference count table
+	int nrefcountblocks;
+	int hash_start;			// First block of the dedup hash table
+	int nhashblocks;
+	int root;			// Inode of the root directory, or zero until the first link
 };
 
 struct fs_inode {
@@ -33,761 +89,3789 @@ struct fs_inode {
 	int indirect;
 };
 
+// The root directory is an extendible hash table.  The root inode holds the table, one
+// bucket inumber per entry, and each bucket is an inode of one block holding the names whose
+// hash ends in the bits the bucket's depth covers.
+#define DIR_NAME_MAX      59
+#define DIR_ENTRY_SIZE    64
+#define DIR_BUCKET_SLOTS  (DISK_BLOCK_SIZE / DIR_ENTRY_SIZE - 1)
+#define DIR_MAX_DEPTH     20		// A table of 2^20 entries is as large as a file can be
+
+struct dir_entry {
+	int inumber;			// Zero for a free slot
+	char name[DIR_NAME_MAX + 1];
+};
+
+struct dir_bucket {
+	int depth;			// Low hash bits shared by every name in the bucket
+	int count;
+	char unused[DIR_ENTRY_SIZE - 2 * sizeof(int)];
+	struct dir_entry entry[DIR_BUCKET_SLOTS];
+};
+
 union fs_block {
 	struct fs_superblock super;
 	struct fs_inode inode[INODES_PER_BLOCK];
 	int pointers[POINTERS_PER_BLOCK];
+	unsigned int checksums[CHECKSUMS_PER_BLOCK];
+	struct dir_bucket bucket;
 	char data[DISK_BLOCK_SIZE];
 };
 
-int fs_format()
+// Geometry of the mounted filesystem, valid while IS_MOUNTED is set
+struct fs_superblock SUPERBLOCK;
+
+// In-memory copy of the checksum table, loaded at mount when FS_FEATURE_CHECKSUM is set
+unsigned int *CHECKSUMS;
+char *CHECKSUM_DIRTY;
+int CHECKSUM_START;
+int NCHECKSUMBLOCKS;
+
+// A table with one entry per disk block, kept in memory and written back a block at a time
+struct block_table {
+	unsigned int *entries;
+	char *dirty;			// Which table blocks changed since the last flush
+	int start;
+	int nblocks;
+};
+
+// Features that let files share blocks, and so need a reference count table
+#define FS_FEATURES_SHARED (FS_FEATURE_DEDUP | FS_FEATURE_REFLINK)
+
+// Reference counts, loaded at mount when blocks may be shared, and content hashes, loaded
+// when FS_FEATURE_DEDUP is set.  A reference count holds the references to a block beyond
+// the first, so a block with one owner has zero there and allocating it needs no table
+// update.  A hash of zero means the block is not in the dedup index.
+struct block_table REFCOUNTS;
+struct block_table HASHES;
+
+// Open-addressed index from content hash to block, rebuilt at mount from the hash table
+int *DEDUP_INDEX;
+int DEDUP_MASK;
+
+// The root directory's table, loaded at mount, with 2^DIR_DEPTH entries.  Null when the
+// filesystem has no root directory yet.
+int *DIR_TABLE;
+int DIR_DEPTH;
+
+// The most recently used cluster, kept decompressed so that reads and writes smaller than a
+// cluster do not decompress it again.  An inumber of zero means the cache is empty.
+static struct {
+	int inumber;
+	int cluster;
+	char data[CLUSTER_SIZE];
+} cluster_cache;
+
+static void cluster_cache_drop( int inumber )
 /*
-Creates a new filesystem on the disk, destroys any data already present.  Sets aside
-10% of the blocks for inodes.  Clears the inode table.  Writes the superblock.  Returns
-one on success and zero on failure.  When attempting to format an already mounted disk,
-it does nothing and returns failure.
+Forgets the cached cluster if it belongs to inumber, or whatever it holds if inumber is zero.
 */
 {
-	if (IS_MOUNTED == 1){
-		// The disk is already mounted so return failure
-		printf("disk has already been mounted so format returns failure");
-		return 0;
+	if (inumber == 0 || cluster_cache.inumber == inumber){
+		cluster_cache.inumber = 0;
 	}
-	else{
+}
 
-		// Initialize a blank block
-		union fs_block new_block;
+static int super_data_start( struct fs_superblock *super )
+/*
+Returns the first block past the superblock, the inode table and any feature metadata.
+*/
+{
+	int start = super->ninodeblocks + 1;
+	if (super->features & FS_FEATURE_CHECKSUM){
+		start = super->checksum_start + super->nchecksumblocks;
+	}
+	if (super->features & FS_FEATURES_SHARED){
+		start = super->refcount_start + super->nrefcountblocks;
+	}
+	if (super->features & FS_FEATURE_DEDUP){
+		start = super->hash_start + super->nhashblocks;
+	}
+	return start;
+}
 
-		// Initialize the superblock
-		struct fs_superblock new_superblock;
-		new_superblock.magic = FS_MAGIC;
-		new_superblock.nblocks = disk_size();
+static int first_data_block()
+{
+	return super_data_start(&SUPERBLOCK);
+}
 
-		// Sets aside 10% of the blocks for inodes
-		new_superblock.ninodeblocks = new_superblock.nblocks * .10 + 1;
-		new_superblock.ninodes = INODES_PER_BLOCK * new_superblock.ninodeblocks;
+static int is_data_block( int blocknum )
+/*
+Returns one if blocknum lies in the data region of the mounted filesystem, i.e. past the
+superblock, inode table and feature metadata and before the end of the disk.
+*/
+{
+	return blocknum >= first_data_block() && blocknum < SUPERBLOCK.nblocks;
+}
 
-		// Clear the inode table
+static int checksum_load( struct fs_superblock *super )
+/*
+Reads the checksum table described by the superblock into memory.  Returns one on success,
+including when the filesystem has no checksums, and zero on failure.
+*/
+{
+	int i;
 
-		struct fs_inode blank_inode;
-		blank_inode.isvalid = 0;
-		blank_inode.size = 0;
-		int j;
-		for (j = 0; j < POINTERS_PER_INODE; j++){blank_inode.direct[j] = 0;}
-		blank_inode.indirect = 0;
-		
-		int i;
-		for (i = 0; i < POINTERS_PER_INODE; i++){
-			new_block.inode[i] = blank_inode;
+	if (!(super->features & FS_FEATURE_CHECKSUM)) return 1;
+	if (super->checksum_start != super->ninodeblocks + 1 ||
+	    super->nchecksumblocks != (super->nblocks + CHECKSUMS_PER_BLOCK - 1) / CHECKSUMS_PER_BLOCK ||
+	    super->checksum_start + super->nchecksumblocks >= super->nblocks){
+		printf("superblock has an invalid checksum table \n");
+		return 0;
+	}
+
+	CHECKSUMS = malloc((size_t)super->nchecksumblocks * DISK_BLOCK_SIZE);
+	CHECKSUM_DIRTY = calloc(super->nchecksumblocks, 1);
+	if (!CHECKSUMS || !CHECKSUM_DIRTY){
+		free(CHECKSUMS);
+		free(CHECKSUM_DIRTY);
+		CHECKSUMS = 0;
+		CHECKSUM_DIRTY = 0;
+		return 0;
+	}
+	for (i = 0; i < super->nchecksumblocks; i++){
+		disk_read(super->checksum_start + i, (char *)CHECKSUMS + (size_t)i * DISK_BLOCK_SIZE);
+	}
+	CHECKSUM_START = super->checksum_start;
+	NCHECKSUMBLOCKS = super->nchecksumblocks;
+	return 1;
+}
+
+static void checksum_flush()
+/*
+Writes back every checksum block changed since the last flush.
+*/
+{
+	int i;
+	if (!CHECKSUMS) return;
+	for (i = 0; i < NCHECKSUMBLOCKS; i++){
+		if (CHECKSUM_DIRTY[i]){
+			CHECKSUM_DIRTY[i] = 0;
+			disk_write(CHECKSUM_START + i, (char *)CHECKSUMS + (size_t)i * DISK_BLOCK_SIZE);
 		}
+	}
+}
 
-		// Write the superblock
-		
-		new_block.super = new_superblock;
+static void checksum_unload()
+{
+	checksum_flush();
+	free(CHECKSUMS);
+	free(CHECKSUM_DIRTY);
+	CHECKSUMS = 0;
+	CHECKSUM_DIRTY = 0;
+}
 
-		disk_write(0, new_block.data);
+static int table_blocks( int nblocks )
+{
+	return (nblocks + ENTRIES_PER_BLOCK - 1) / ENTRIES_PER_BLOCK;
+}
 
-		return 1;
+static int table_load( struct block_table *t, int start, int nblocks )
+{
+	int i;
 
+	t->entries = malloc((size_t)nblocks * DISK_BLOCK_SIZE);
+	t->dirty = calloc(nblocks, 1);
+	if (!t->entries || !t->dirty){
+		free(t->entries);
+		free(t->dirty);
+		t->entries = 0;
+		t->dirty = 0;
+		return 0;
 	}
-	return 0;
+	for (i = 0; i < nblocks; i++){
+		disk_read(start + i, (char *)t->entries + (size_t)i * DISK_BLOCK_SIZE);
+	}
+	t->start = start;
+	t->nblocks = nblocks;
+	return 1;
 }
 
-void fs_debug()
+static void table_set( struct block_table *t, int blocknum, unsigned int value )
+{
+	if (t->entries[blocknum] != value){
+		t->entries[blocknum] = value;
+		t->dirty[blocknum / ENTRIES_PER_BLOCK] = 1;
+	}
+}
+
+static void table_flush( struct block_table *t )
+{
+	int i;
+	if (!t->entries) return;
+	for (i = 0; i < t->nblocks; i++){
+		if (t->dirty[i]){
+			t->dirty[i] = 0;
+			disk_write(t->start + i, (char *)t->entries + (size_t)i * DISK_BLOCK_SIZE);
+		}
+	}
+}
+
+static void table_unload( struct block_table *t )
+{
+	table_flush(t);
+	free(t->entries);
+	free(t->dirty);
+	t->entries = 0;
+	t->dirty = 0;
+}
+
+static int refcount_load( struct fs_superblock *super )
 /*
-Scans a mounted filesystem and reports on how the inodes and blocks are organized 
+Reads the reference count table, and the hash table with dedup, described by the
+superblock into memory.  Returns one on success, including when the filesystem does not
+share blocks, and zero on failure.
 */
 {
-	union fs_block block;
-	union fs_block indirect_block;
+	if (!(super->features & FS_FEATURES_SHARED)) return 1;
 
-	disk_read(0,block.data);
-
-	printf("superblock:\n");
-	int magic_number = block.super.magic; 
-	if (magic_number == FS_MAGIC){
-		printf("    magic number is valid\n");
+	int expected = super->ninodeblocks + 1;
+	if (super->features & FS_FEATURE_CHECKSUM){
+		expected = super->checksum_start + super->nchecksumblocks;
 	}
-	else {
-		printf("    magic number is invalid\n");
+	if (super->refcount_start != expected ||
+	    super->nrefcountblocks != table_blocks(super->nblocks) ||
+	    super->refcount_start + super->nrefcountblocks >= super->nblocks){
+		printf("superblock has an invalid reference count table \n");
+		return 0;
+	}
+	if ((super->features & FS_FEATURE_DEDUP) &&
+	    (super->hash_start != super->refcount_start + super->nrefcountblocks ||
+	     super->nhashblocks != super->nrefcountblocks ||
+	     super->hash_start + super->nhashblocks >= super->nblocks)){
+		printf("superblock has an invalid dedup hash table \n");
+		return 0;
 	}
-	printf("    %d blocks\n",block.super.nblocks);
-	int num_blocks = block.super.nblocks;
-	printf("    %d inode blocks\n",block.super.ninodeblocks);
-	printf("    %d inodes\n",block.super.ninodes);
 
-	int num_inode_blocks = block.super.ninodeblocks;
-	int num_inodes = block.super.ninodes;
-	int num_inodes_per_block = num_inodes / num_inode_blocks;
+	if (!table_load(&REFCOUNTS, super->refcount_start, super->nrefcountblocks)) return 0;
+	if ((super->features & FS_FEATURE_DEDUP) && !table_load(&HASHES, super->hash_start, super->nhashblocks)){
+		table_unload(&REFCOUNTS);
+		return 0;
+	}
+	return 1;
+}
 
-	int i, j, k, m;
-	for (j = 0; j < num_inode_blocks; j++){
-		disk_read(j, block.data);
-		for (i = 1; i < num_inodes_per_block; i++){
-			//printf("block.inode is valid = %d \n", block.inode[i].isvalid);
-			if (block.inode[i].isvalid == 1){
-				printf("inode %d:\n", i);
-				printf("    size %d bytes\n",block.inode[i].size);
-				printf("    direct blocks:");
-				for (k = 0; k < POINTERS_PER_INODE; k++){
-					if (block.inode[i].direct[k] != 0){
-						printf(" %d ", block.inode[i].direct[k]);
-					}
-				}
-				printf("\n");
-				if (block.inode[i].indirect != 0){
-					printf("    indirect block: %d \n", block.inode[i].indirect);
-					printf("    indirect data blocks:");
-					disk_read(block.inode[i].indirect, indirect_block.data);
-					for (m = 0; m < POINTERS_PER_BLOCK; m++){
-						if ((indirect_block.pointers[m] != 0) && (indirect_block.pointers[m] < num_blocks) && (indirect_block.pointers[m] > 0)){
+static void refcount_unload()
+{
+	table_unload(&REFCOUNTS);
+	table_unload(&HASHES);
+}
 
-							printf(" %d ", indirect_block.pointers[m]);
-						}
-					}
-					printf("\n");
+static void metadata_flush()
+/*
+Writes back the parts of the checksum, reference count and hash tables changed by the
+operation just finished.
+*/
+{
+	checksum_flush();
+	table_flush(&REFCOUNTS);
+	table_flush(&HASHES);
+}
 
-				}
-			}
-		}
-		
-	}
+static int block_verify( int blocknum, const char *data )
+{
+	return !CHECKSUMS || crc32c(0, data, DISK_BLOCK_SIZE) == CHECKSUMS[blocknum];
 }
 
+static int block_read( int blocknum, char *data )
 /*
-Examines the disk for a filesystem. If one is present, reads the superblock, builds a free
-block bitmap and prepares the filesystem for use.  Returns one on success and zero on 
-failure.
+Reads a data or indirect block and verifies it against the checksum table, if there is one.
+Returns one if the block is intact and zero if its checksum does not match.
 */
-
-int fs_mount()
 {
-	if (IS_MOUNTED == 1){
-		printf("disk has already been mounted \n");
+	disk_read(blocknum, data);
+	if (!block_verify(blocknum, data)){
+		printf("checksum mismatch on block %d \n", blocknum);
 		return 0;
 	}
-	else{
-		union fs_block block;
-		union fs_block indirect_block;
+	return 1;
+}
 
-		disk_read(0,block.data);
-		int magic_number = block.super.magic;
+static int blocks_read( const int *blocknums, char *const *data, int n )
+/*
+Reads n data blocks with one call to the disk layer and verifies each against the checksum
+table.  Returns how many blocks, counting from the first, are intact.
+*/
+{
+	int i;
 
-		// Check if a file system is present
-		if (magic_number == FS_MAGIC){
-			// Read the superblock
-			struct fs_superblock superblock;
-			superblock = block.super;
-			superblock.nblocks = disk_size();
-			superblock.ninodeblocks = round(superblock.nblocks * .10);
-			superblock.ninodes = INODES_PER_BLOCK * superblock.ninodeblocks;
+	disk_readv(blocknums, data, n);
+	for (i = 0; i < n; i++){
+		if (!block_verify(blocknums[i], data[i])){
+			printf("checksum mismatch on block %d \n", blocknums[i]);
+			return i;
+		}
+	}
+	return n;
+}
 
-			int i, j, k, m;
+static void block_write( int blocknum, const char *data )
+/*
+Writes a data or indirect block and records its checksum.  The checksum table itself is
+written back by checksum_flush() once the whole operation is done.
+*/
+{
+	disk_write(blocknum, data);
+	if (CHECKSUMS){
+		CHECKSUMS[blocknum] = crc32c(0, data, DISK_BLOCK_SIZE);
+		CHECKSUM_DIRTY[blocknum / CHECKSUMS_PER_BLOCK] = 1;
+	}
+}
 
-			// Initialize and fill the bitmaps with zeros for now
-			BLOCK_BITMAP = malloc(sizeof(int)*superblock.nblocks); 
-			for (i = 0; i < superblock.nblocks; i++){ BLOCK_BITMAP[i] = 0;}
-			INODE_BITMAP = malloc(sizeof(int)*superblock.ninodes); 
-			for (i = 0; i < superblock.ninodes; i++){INODE_BITMAP[i] = 0;}
-			
-			// Iterate through and update any unavailable positions with 1s
-			for (j = 1; j < superblock.ninodeblocks; j++){
-				disk_read(j, block.data);
-				for (i = 0; i < INODES_PER_BLOCK; i++){
-					if (block.inode[i].isvalid != 0){
-						INODE_BITMAP[i] = 1;
-						for (k = 0; k < POINTERS_PER_INODE; k++){
-							if (block.inode[i].direct[k] != 0){
-								BLOCK_BITMAP[block.inode[i].direct[k]] = 1;
-							}
-						}
-						if (block.inode[i].indirect != 0){
-							BLOCK_BITMAP[block.inode[i].indirect] = 1;
+static void blocks_write( const int *blocknums, const char *const *data, int n )
+/*
+Writes n data blocks with one call to the disk layer and records their checksums.
+*/
+{
+	int i;
 
-							disk_read(block.inode[i].indirect, indirect_block.data);
-							for (m = 0; m < POINTERS_PER_BLOCK; m++){
+	disk_writev(blocknums, data, n);
+	for (i = 0; CHECKSUMS && i < n; i++){
+		CHECKSUMS[blocknums[i]] = crc32c(0, data[i], DISK_BLOCK_SIZE);
+		CHECKSUM_DIRTY[blocknums[i] / CHECKSUMS_PER_BLOCK] = 1;
+	}
+}
 
-								if (indirect_block.pointers[m] != 0){
-									 BLOCK_BITMAP[indirect_block.pointers[m]] = 1;
-								}
-							}
-						}
+static unsigned int dedup_hash( const char *data )
+/*
+Hashes a full data block for the dedup index.  Zero is kept to mean "not indexed".
+*/
+{
+	unsigned int hash = crc32c(0, data, DISK_BLOCK_SIZE);
+	return hash ? hash : 1;
+}
 
-					}
-				}
-			}		
-			int p;
-			// Reserve all inode blocks in the free block bitmap
-			for (p = 1; p < superblock.ninodeblocks; p++){
-				BLOCK_BITMAP[p] = 1;
-			}	
+static void dedup_insert( int blocknum, unsigned int hash )
+{
+	int i = hash & DEDUP_MASK;
+	table_set(&HASHES, blocknum, hash);
+	while (DEDUP_INDEX[i] != 0) i = (i + 1) & DEDUP_MASK;
+	DEDUP_INDEX[i] = blocknum;
+}
 
-			IS_MOUNTED = 1;
-			return 1;
+static void dedup_forget( int blocknum )
+/*
+Takes a block out of the dedup index, if it is there, before its contents change or it is
+freed.  Later entries in the probe run are shifted back so that no lookup stops short.
+*/
+{
+	if (!DEDUP_INDEX || HASHES.entries[blocknum] == 0) return;
+
+	int i = HASHES.entries[blocknum] & DEDUP_MASK;
+	while (DEDUP_INDEX[i] != blocknum){
+		if (DEDUP_INDEX[i] == 0) break;
+		i = (i + 1) & DEDUP_MASK;
+	}
+	table_set(&HASHES, blocknum, 0);
+	if (DEDUP_INDEX[i] == 0) return;
+
+	int j = i;
+	while (1){
+		DEDUP_INDEX[i] = 0;
+		while (1){
+			j = (j + 1) & DEDUP_MASK;
+			if (DEDUP_INDEX[j] == 0) return;
+			int home = HASHES.entries[DEDUP_INDEX[j]] & DEDUP_MASK;
+			// Move the entry back unless its home lies cyclically in (i, j]
+			if (i <= j ? (home <= i || home > j) : (home <= i && home > j)) break;
 		}
+		DEDUP_INDEX[i] = DEDUP_INDEX[j];
+		i = j;
 	}
-	
-	return 0;
 }
 
-int fs_create()
+static int dedup_find( const char *data, unsigned int hash )
 /*
-Create a new inode of zero length. On success, return the (positive) inumber. On failure, return zero.
+Returns a block already holding exactly these contents, or zero if there is none.  Every
+candidate with a matching hash is read and compared, so a hash collision costs a read but
+never shares the wrong data.
 */
 {
-	if (IS_MOUNTED == 0){
-		printf("disk not yet mounted \n");
-		return 0;
+	union fs_block block;
+	int i;
+
+	if (!DEDUP_INDEX) return 0;
+	for (i = hash & DEDUP_MASK; DEDUP_INDEX[i] != 0; i = (i + 1) & DEDUP_MASK){
+		int candidate = DEDUP_INDEX[i];
+		if (HASHES.entries[candidate] != hash) continue;
+		if (block_read(candidate, block.data) && memcmp(block.data, data, DISK_BLOCK_SIZE) == 0){
+			return candidate;
+		}
 	}
-	struct fs_inode new;
-	new.size = 0;
+	return 0;
+}
 
-	// Get the number of inodes
-	union fs_block block;
-	disk_read(0, block.data);
-	
-	int num_inodes = block.super.ninodes;
+static int block_in_use( int blocknum )
+{
+	return (BLOCK_BITMAP[blocknum / 64] >> (blocknum % 64)) & 1;
+}
 
-	int i, j;
-	for (i = 0; i < num_inodes; i++){
-		if ((INODE_BITMAP[i] == 0) && (i > 0)){
-			INODE_BITMAP[i] = 1; 
+static void block_mark_used( int blocknum )
+{
+	BLOCK_BITMAP[blocknum / 64] |= 1ULL << (blocknum % 64);
+}
 
-			// Get the block number
-			int block_num = i / 127 + 1;
-			union fs_block block_to_edit;
-			disk_read(block_num, block_to_edit.data);
+static void block_mark_free( int blocknum )
+{
+	BLOCK_BITMAP[blocknum / 64] &= ~(1ULL << (blocknum % 64));
+	if (blocknum < FREE_HINT) FREE_HINT = blocknum;
+}
 
-			struct fs_inode inode_to_write;
-			inode_to_write.isvalid = 1;
-			inode_to_write.size = 0;
-			for (j = 0; j < POINTERS_PER_INODE; j++){
-				inode_to_write.direct[j] = 0;
-			}
-			inode_to_write.indirect = 0;
+static void block_mark_run_free( int start, int n )
+/*
+Clears the free block map bits of blocks start..start+n-1 a word at a time.
+*/
+{
+	int end = start + n;
+
+	if (start < FREE_HINT) FREE_HINT = start;
+	while (start < end){
+		int bits = 64 - start % 64;
+		if (bits > end - start) bits = end - start;
+		unsigned long long mask = bits == 64 ? ~0ULL : ((1ULL << bits) - 1) << (start % 64);
+		BLOCK_BITMAP[start / 64] &= ~mask;
+		start += bits;
+	}
+}
 
-			// Write the new inode
-			block_to_edit.inode[i] = inode_to_write;
-			disk_write(block_num, block_to_edit.data);
+static int dedup_build_index()
+/*
+Indexes every in-use block that has a hash, and clears table entries left behind on free
+blocks.  Called at mount once the free block bitmap is built.
+*/
+{
+	int i, size = 1;
+
+	if (!REFCOUNTS.entries) return 1;
+	if (HASHES.entries){
+		while (size < 2 * SUPERBLOCK.nblocks) size *= 2;
+		free(DEDUP_INDEX);
+		DEDUP_INDEX = calloc(size, sizeof(int));
+		if (!DEDUP_INDEX) return 0;
+		DEDUP_MASK = size - 1;
+	}
+
+	for (i = 0; i < SUPERBLOCK.nblocks; i++){
+		if (!block_in_use(i)){
+			table_set(&REFCOUNTS, i, 0);
+			if (HASHES.entries) table_set(&HASHES, i, 0);
+		}
+		else if (HASHES.entries && HASHES.entries[i] != 0){
+			dedup_insert(i, HASHES.entries[i]);
+		}
+	}
+	return 1;
+}
+
+static int block_shared( int blocknum )
+{
+	return REFCOUNTS.entries && REFCOUNTS.entries[blocknum] > 0;
+}
+
+static void block_share( int blocknum )
+{
+	table_set(&REFCOUNTS, blocknum, REFCOUNTS.entries[blocknum] + 1);
+}
+
+static void block_release( int blocknum )
+/*
+Drops one reference to a data or indirect block, freeing it once nothing refers to it.
+*/
+{
+	if (block_shared(blocknum)){
+		table_set(&REFCOUNTS, blocknum, REFCOUNTS.entries[blocknum] - 1);
+		return;
+	}
+	dedup_forget(blocknum);
+	block_mark_free(blocknum);
+}
+
+static int compare_ints( const void *a, const void *b )
+{
+	int x = *(const int *)a;
+	int y = *(const int *)b;
+	return (x > y) - (x < y);
+}
+
+static void blocks_release( int *blocks, int n )
+/*
+Drops one reference to each of n blocks, like block_release, but clears the free block map
+a run at a time.  Blocks still shared with another file only lose the reference; the rest
+are sorted in place so that each run of neighbouring blocks is cleared a whole word of the
+map at a time.
+*/
+{
+	int i, nfree = 0;
+
+	for (i = 0; i < n; i++){
+		if (block_shared(blocks[i])){
+			table_set(&REFCOUNTS, blocks[i], REFCOUNTS.entries[blocks[i]] - 1);
+			continue;
+		}
+		dedup_forget(blocks[i]);
+		blocks[nfree++] = blocks[i];
+	}
+	qsort(blocks, nfree, sizeof(int), compare_ints);
+
+	for (i = 0; i < nfree; ){
+		int run = 1;
+		while (i + run < nfree && blocks[i + run] == blocks[i] + run) run++;
+		block_mark_run_free(blocks[i], run);
+		i = i + run;
+	}
+}
+
+int get_free_block()
+/*
+Returns the lowest free data block, or zero if the disk is full.  The search resumes at
+FREE_HINT instead of the start of the disk, so a file that grows block by block does not
+rescan the blocks it already took, and nothing is read from the disk.  Words of the free
+block map with every block in use are passed over whole.
+*/
+{
+	int i;
+	if (FREE_HINT < first_data_block()) FREE_HINT = first_data_block();
+	for (i = FREE_HINT; i < SUPERBLOCK.nblocks; i = (i / 64 + 1) * 64){
+		// Treat the blocks below i in its word as in use
+		unsigned long long used = BLOCK_BITMAP[i / 64] | ((1ULL << (i % 64)) - 1);
+		if (used != ~0ULL){
+			i = i / 64 * 64 + __builtin_ctzll(~used);
+			if (i >= SUPERBLOCK.nblocks) break;
+			FREE_HINT = i;
+			return i;
+		}
+	}
+	FREE_HINT = SUPERBLOCK.nblocks;
+	return 0;
+}
+
+static int indirect_unshare( int *indirect, union fs_block *block )
+/*
+Gives a file its own copy of an indirect block it shares with a clone, so that its block
+map can change.  Every block the copy points to gains a reference, since both indirect
+blocks now refer to it.  Returns zero if the disk is full.
+*/
+{
+	int i;
+
+	if (!block_shared(*indirect)) return 1;
+	int copy = get_free_block();
+	if (copy == 0) return 0;
+	block_mark_used(copy);
+	for (i = 0; i < POINTERS_PER_BLOCK; i++){
+		if (is_data_block(block->pointers[i])) block_share(block->pointers[i]);
+	}
+	block_write(copy, block->data);
+	block_release(*indirect);
+	*indirect = copy;
+	return 1;
+}
+
+static int inode_index_build()
+/*
+Builds the free-inode index from INODE_BITMAP.  Inode 0 is never handed out.
+*/
+{
+	int i;
+	int words = (SUPERBLOCK.ninodes + 63) / 64;
+
+	free(INODE_FREE);
+	free(INODE_FREE_SUMMARY);
+	INODE_FREE = calloc(words, sizeof(unsigned long long));
+	INODE_FREE_SUMMARY = calloc((words + 63) / 64, sizeof(unsigned long long));
+	if (!INODE_FREE || !INODE_FREE_SUMMARY) return 0;
+	INODE_FREE_WORDS = words;
+
+	for (i = 1; i < SUPERBLOCK.ninodes; i++){
+		if (!INODE_BITMAP[i]){
+			INODE_FREE[i / 64] |= 1ULL << (i % 64);
+			INODE_FREE_SUMMARY[i / 4096] |= 1ULL << (i / 64 % 64);
+		}
+	}
+	return 1;
+}
+
+static int inode_index_first()
+/*
+Returns the lowest free inumber, or zero if every inode is in use.
+*/
+{
+	int i;
+	for (i = 0; i < (INODE_FREE_WORDS + 63) / 64; i++){
+		if (INODE_FREE_SUMMARY[i]){
+			int word = i * 64 + __builtin_ctzll(INODE_FREE_SUMMARY[i]);
+			return word * 64 + __builtin_ctzll(INODE_FREE[word]);
+		}
+	}
+	return 0;
+}
+
+static void inode_mark_used( int inumber )
+{
+	INODE_BITMAP[inumber] = 1;
+	INODE_FREE[inumber / 64] &= ~(1ULL << (inumber % 64));
+	if (INODE_FREE[inumber / 64] == 0){
+		INODE_FREE_SUMMARY[inumber / 4096] &= ~(1ULL << (inumber / 64 % 64));
+	}
+}
+
+static void inode_mark_free( int inumber )
+{
+	INODE_BITMAP[inumber] = 0;
+	if (inumber == 0) return;
+	INODE_FREE[inumber / 64] |= 1ULL << (inumber % 64);
+	INODE_FREE_SUMMARY[inumber / 4096] |= 1ULL << (inumber / 64 % 64);
+}
+
+static int is_valid_inumber( int inumber )
+{
+	return inumber > 0 && inumber < SUPERBLOCK.ninodes;
+}
+
+static void inode_load( int inumber, struct fs_inode *inode )
+/*
+Reads the inode with the given number from the inode table.
+*/
+{
+	union fs_block block;
+	disk_read(inumber/INODES_PER_BLOCK + 1, block.data);
+	*inode = block.inode[inumber % INODES_PER_BLOCK];
+}
+
+static void inode_save( int inumber, struct fs_inode *inode )
+/*
+Writes the inode with the given number back to the inode table.
+*/
+{
+	union fs_block block;
+	disk_read(inumber/INODES_PER_BLOCK + 1, block.data);
+	block.inode[inumber % INODES_PER_BLOCK] = *inode;
+	disk_write(inumber/INODES_PER_BLOCK + 1, block.data);
+}
+
+static int inode_in_use( struct fs_inode *inode )
+{
+	return inode->isvalid == INODE_VALID || inode->isvalid == (INODE_VALID | INODE_COMPRESSED) ||
+	       inode->isvalid == (INODE_VALID | INODE_DIRECTORY);
+}
+
+static int inode_is_directory( int inumber )
+/*
+Refuses a per-inode call on one of the root directory's inodes, which only the directory
+calls may change.  Returns one, after saying so, if the inode belongs to the directory.
+*/
+{
+	if (IS_MOUNTED == 0 || !is_valid_inumber(inumber) || INODE_BITMAP[inumber] != DIRECTORY_INODE) return 0;
+	printf("inode %d belongs to the root directory \n", inumber);
+	return 1;
+}
+
+static int do_format( int features )
+/*
+Creates a new filesystem on the disk, destroys any data already present.  Sets aside
+10% of the blocks for inodes.  Clears the inode table.  Writes the superblock.  Returns
+one on success and zero on failure.  When attempting to format an already mounted disk,
+it does nothing and returns failure.  With FS_FEATURE_CHECKSUM, a checksum table with
+one entry per block is placed right after the inode table.  FS_FEATURE_REFLINK adds a
+reference count table with one entry per block after that, and FS_FEATURE_DEDUP adds both
+the reference count table and a content hash table.
+*/
+{
+	if (IS_MOUNTED == 1){
+		// The disk is already mounted so return failure
+		printf("disk has already been mounted so format returns failure");
+		return 0;
+	}
+	else{
+
+		// Initialize a blank block
+		union fs_block new_block;
+
+		// Initialize the superblock
+		struct fs_superblock new_superblock;
+		memset(&new_superblock, 0, sizeof(new_superblock));
+		new_superblock.magic = FS_MAGIC;
+		new_superblock.nblocks = disk_size();
+
+		// Sets aside 10% of the blocks for inodes
+		new_superblock.ninodeblocks = new_superblock.nblocks * .10 + 1;
+		new_superblock.ninodes = INODES_PER_BLOCK * new_superblock.ninodeblocks;
+
+		new_superblock.features = features;
+		int next = new_superblock.ninodeblocks + 1;
+		if (features & FS_FEATURE_CHECKSUM){
+			new_superblock.checksum_start = next;
+			new_superblock.nchecksumblocks = (new_superblock.nblocks + CHECKSUMS_PER_BLOCK - 1) / CHECKSUMS_PER_BLOCK;
+			next += new_superblock.nchecksumblocks;
+		}
+		if (features & FS_FEATURES_SHARED){
+			new_superblock.refcount_start = next;
+			new_superblock.nrefcountblocks = table_blocks(new_superblock.nblocks);
+			next += new_superblock.nrefcountblocks;
+		}
+		if (features & FS_FEATURE_DEDUP){
+			new_superblock.hash_start = next;
+			new_superblock.nhashblocks = new_superblock.nrefcountblocks;
+		}
+		if (super_data_start(&new_superblock) >= new_superblock.nblocks){
+			printf("disk is too small for the requested features \n");
+			return 0;
+		}
+
+		// Clear the inode table and any feature metadata
+		memset(new_block.data, 0, DISK_BLOCK_SIZE);
+		int i;
+		for (i = 1; i < super_data_start(&new_superblock); i++){
+			disk_write(i, new_block.data);
+		}
+
+		// Write the superblock
+		new_block.super = new_superblock;
+
+		disk_write(0, new_block.data);
+
+		return 1;
+
+	}
+	return 0;
+}
+
+int fs_format()
+{
+	return fs_format_features(0);
+}
+
+int fs_format_features( int features )
+{
+	int caller = disk_trace_caller(TRACE_CALLER_FORMAT);
+	pthread_rwlock_wrlock(&FS_LOCK);
+	int result = do_format(features);
+	pthread_rwlock_unlock(&FS_LOCK);
+	disk_trace_caller(caller);
+	return result;
+}
+
+static void do_debug()
+/*
+Scans a mounted filesystem and reports on how the inodes and blocks are organized 
+*/
+{
+	union fs_block block;
+	union fs_block indirect_block;
+
+	disk_read(0,block.data);
+
+	printf("superblock:\n");
+	int magic_number = block.super.magic; 
+	if (magic_number == FS_MAGIC){
+		printf("    magic number is valid\n");
+	}
+	else {
+		printf("    magic number is invalid\n");
+	}
+	printf("    %d blocks\n",block.super.nblocks);
+	int num_blocks = block.super.nblocks;
+	printf("    %d inode blocks\n",block.super.ninodeblocks);
+	printf("    %d inodes\n",block.super.ninodes);
+
+	int num_inode_blocks = block.super.ninodeblocks;
+	int num_inodes = block.super.ninodes;
+	int num_inodes_per_block = num_inodes / num_inode_blocks;
+
+	int i, j, k, m;
+	for (j = 0; j < num_inode_blocks; j++){
+		disk_read(j, block.data);
+		for (i = 1; i < num_inodes_per_block; i++){
+			//printf("block.inode is valid = %d \n", block.inode[i].isvalid);
+			if (inode_in_use(&block.inode[i])){
+				printf("inode %d:\n", i);
+				printf("    size %d bytes\n",block.inode[i].size);
+				if (block.inode[i].isvalid & INODE_COMPRESSED){
+					printf("    compressed\n");
+				}
+				printf("    direct blocks:");
+				for (k = 0; k < POINTERS_PER_INODE; k++){
+					if (block.inode[i].direct[k] > 0){
+						printf(" %d ", block.inode[i].direct[k]);
+					}
+				}
+				printf("\n");
+				if (block.inode[i].indirect != 0){
+					printf("    indirect block: %d \n", block.inode[i].indirect);
+					printf("    indirect data blocks:");
+					disk_read(block.inode[i].indirect, indirect_block.data);
+					for (m = 0; m < POINTERS_PER_BLOCK; m++){
+						if ((indirect_block.pointers[m] != 0) && (indirect_block.pointers[m] < num_blocks) && (indirect_block.pointers[m] > 0)){
+
+							printf(" %d ", indirect_block.pointers[m]);
+						}
+					}
+					printf("\n");
+
+				}
+			}
+		}
+		
+	}
+}
+
+void fs_debug()
+{
+	pthread_rwlock_wrlock(&FS_LOCK);
+	do_debug();
+	pthread_rwlock_unlock(&FS_LOCK);
+}
+
+/*
+Examines the disk for a filesystem. If one is present, reads the superblock, builds a free
+block bitmap and prepares the filesystem for use.  Returns one on success and zero on 
+failure.
+*/
+
+// Loads the root directory at mount; defined with the rest of the directory code
+static int dir_load();
+
+static int do_mount()
+{
+	if (IS_MOUNTED == 1){
+		printf("disk has already been mounted \n");
+		return 0;
+	}
+	else{
+		union fs_block block;
+		union fs_block indirect_block;
+
+		disk_read(0,block.data);
+		int magic_number = block.super.magic;
+
+		// Check if a file system is present
+		if (magic_number == FS_MAGIC){
+			// Read the superblock and keep the geometry it describes
+			struct fs_superblock superblock;
+			superblock = block.super;
+			superblock.nblocks = disk_size();
+			if (superblock.ninodeblocks < 1 || superblock.ninodeblocks >= superblock.nblocks){
+				printf("superblock has an invalid inode table size \n");
+				return 0;
+			}
+			superblock.ninodes = INODES_PER_BLOCK * superblock.ninodeblocks;
+			if (!checksum_load(&superblock)){
+				return 0;
+			}
+			if (!refcount_load(&superblock)){
+				checksum_unload();
+				return 0;
+			}
+			SUPERBLOCK = superblock;
+			cluster_cache_drop(0);
+
+			int i, j, k, m, p;
+
+			// Initialize and fill the bitmaps with zeros for now
+			BLOCK_BITMAP = calloc((superblock.nblocks + 63) / 64, sizeof(unsigned long long));
+			INODE_BITMAP = malloc(sizeof(int)*superblock.ninodes); 
+			for (i = 0; i < superblock.ninodes; i++){INODE_BITMAP[i] = 0;}
+			
+			// Iterate through every inode block and mark the blocks each inode in use refers to.
+			// Pointers outside the data region are skipped here; fsck reports them.
+			for (j = 1; j <= superblock.ninodeblocks; j++){
+				disk_read(j, block.data);
+				for (i = 0; i < INODES_PER_BLOCK; i++){
+					if (inode_in_use(&block.inode[i])){
+						INODE_BITMAP[(j-1)*INODES_PER_BLOCK + i] = (block.inode[i].isvalid & INODE_DIRECTORY) ? DIRECTORY_INODE : 1;
+						for (k = 0; k < POINTERS_PER_INODE; k++){
+							if (is_data_block(block.inode[i].direct[k])){
+								block_mark_used(block.inode[i].direct[k]);
+							}
+						}
+						if (is_data_block(block.inode[i].indirect)){
+							block_mark_used(block.inode[i].indirect);
+
+							// A damaged indirect block is reported but its pointers still claim
+							// their blocks, so nothing it may refer to gets handed out again
+							block_read(block.inode[i].indirect, indirect_block.data);
+							for (m = 0; m < POINTERS_PER_BLOCK; m++){
+
+								if (is_data_block(indirect_block.pointers[m])){
+									 block_mark_used(indirect_block.pointers[m]);
+								}
+							}
+						}
+
+					}
+				}
+			}		
+			if (!inode_index_build()){
+				printf("not enough memory for the free-inode index \n");
+				return 0;
+			}
+
+			// Reserve the superblock, all inode blocks and feature metadata in the free block bitmap
+			for (p = 0; p < first_data_block(); p++){
+				block_mark_used(p);
+			}	
+			FREE_HINT = first_data_block();
+			if (!dedup_build_index()){
+				printf("not enough memory for the dedup index \n");
+				return 0;
+			}
+			metadata_flush();
+
+			IS_MOUNTED = 1;
+			if (!dir_load()){
+				printf("the root directory is damaged; run fsck repair \n");
+				IS_MOUNTED = 0;
+				free(BLOCK_BITMAP);
+				free(INODE_BITMAP);
+				BLOCK_BITMAP = 0;
+				INODE_BITMAP = 0;
+				checksum_unload();
+				refcount_unload();
+				return 0;
+			}
+			return 1;
+		}
+	}
+	
+	return 0;
+}
+
+int fs_mount()
+{
+	struct stats_timer t;
+	int caller = disk_trace_caller(TRACE_CALLER_MOUNT);
+	stats_begin(&t);
+	pthread_rwlock_wrlock(&FS_LOCK);
+	int result = do_mount();
+	pthread_rwlock_unlock(&FS_LOCK);
+	stats_end(&t, STATS_FS_MOUNT, 0);
+	disk_trace_caller(caller);
+	return result;
+}
+
+static int do_create_many( int n, int *inumbers )
+/*
+Creates up to n new inodes of zero length, taking the lowest free inumbers, and stores their
+numbers in inumbers.  The new inodes are written an inode block at a time, and a block with
+no inode in use is written without being read first.  Returns the number of inodes created,
+which is short of n only if the inode table fills up.
+*/
+{
+	if (IS_MOUNTED == 0){
+		printf("disk not yet mounted \n");
+		return 0;
+	}
+
+	struct fs_inode new;
+	memset(&new, 0, sizeof(new));
+	new.isvalid = INODE_VALID;
+
+	int count = 0;
+	int inumber = inode_index_first();
+	while (count < n && inumber != 0){
+		int block_num = inumber / INODES_PER_BLOCK + 1;
+		int first = (block_num - 1) * INODES_PER_BLOCK;
+		union fs_block block_to_edit;
+		int i, empty = 1;
+
+		for (i = first; i < first + INODES_PER_BLOCK; i++){
+			if (INODE_BITMAP[i]) empty = 0;
+		}
+		if (empty){
+			memset(block_to_edit.data, 0, DISK_BLOCK_SIZE);
+		}
+		else{
+			disk_read(block_num, block_to_edit.data);
+		}
+
+		// Take every free inode this block has, up to the number still wanted
+		while (count < n && inumber != 0 && inumber / INODES_PER_BLOCK + 1 == block_num){
+			inode_mark_used(inumber);
+			block_to_edit.inode[inumber % INODES_PER_BLOCK] = new;
+			inumbers[count++] = inumber;
+			inumber = inode_index_first();
+		}
+
+		// Write the new inodes
+		disk_write(block_num, block_to_edit.data);
+	}
+	return count;
+}
+
+static int do_create()
+/*
+Create a new inode of zero length. On success, return the (positive) inumber. On failure, return zero.
+*/
+{
+	int inumber;
+	if (do_create_many(1, &inumber) != 1) return 0;
+	return inumber;
+}
+
+int fs_create()
+{
+	struct stats_timer t;
+	int caller = disk_trace_caller(TRACE_CALLER_CREATE);
+	stats_begin(&t);
+	pthread_rwlock_wrlock(&FS_LOCK);
+	int result = do_create();
+	pthread_rwlock_unlock(&FS_LOCK);
+	stats_end(&t, STATS_FS_CREATE, 0);
+	disk_trace_caller(caller);
+	return result;
+}
+
+int fs_create_many( int n, int *inumbers )
+{
+	struct stats_timer t;
+	int caller = disk_trace_caller(TRACE_CALLER_CREATE);
+	stats_begin(&t);
+	pthread_rwlock_wrlock(&FS_LOCK);
+	int result = do_create_many(n, inumbers);
+	pthread_rwlock_unlock(&FS_LOCK);
+	stats_end(&t, STATS_FS_CREATE, 0);
+	disk_trace_caller(caller);
+	return result;
+}
+
+static int do_clone( int inumber )
+/*
+Creates a new inode with the same contents as the given one by sharing its blocks rather
+than copying them.  Only the direct blocks and the indirect block gain a reference, since
+everything behind the indirect block is shared along with it, so a clone takes the same
+time however large the file is.  Writes to either file later copy each shared block they
+touch.  Needs a filesystem formatted with reflink or dedup.  On success, returns the new
+inumber.  On failure, returns zero.
+*/
+{
+	struct fs_inode inode;
+	int i;
+
+	if (IS_MOUNTED == 0){
+		printf("disk not yet mounted \n");
+		return 0;
+	}
+	if (!REFCOUNTS.entries){
+		printf("cloning needs a filesystem formatted with reflink or dedup \n");
+		return 0;
+	}
+	if (!is_valid_inumber(inumber) || INODE_BITMAP[inumber] == 0){
+		printf("%d is not a valid inode to clone \n", inumber);
+		return 0;
+	}
+
+	int caller = disk_trace_caller(TRACE_CALLER_CREATE);
+	int clone = do_create();
+	disk_trace_caller(caller);
+	if (clone == 0) return 0;
+
+	inode_load(inumber, &inode);
+	for (i = 0; i < POINTERS_PER_INODE; i++){
+		if (is_data_block(inode.direct[i])) block_share(inode.direct[i]);
+	}
+	if (is_data_block(inode.indirect)) block_share(inode.indirect);
+	inode_save(clone, &inode);
+	metadata_flush();
+	return clone;
+}
+
+int fs_clone( int inumber )
+{
+	pthread_rwlock_wrlock(&FS_LOCK);
+	int result = inode_is_directory(inumber) ? 0 : do_clone(inumber);
+	pthread_rwlock_unlock(&FS_LOCK);
+	return result;
+}
+
+static int do_getsize( int inumber )
+/*
+Return the logical size of the given inode, in bytes. Note that zero is a valid logical size 
+for an inode! On failure, return -1.
+*/
+{
+	// Convert the numbers
+	int block_number = inumber/INODES_PER_BLOCK + 1;
+	int i_number = inumber % INODES_PER_BLOCK;
+
+	if (inumber <= 0 || block_number >= disk_size()){
+		return -1;
+	}
+	
+	// Read the block
+	union fs_block block;
+	disk_read(block_number, block.data);
+
+	if (inode_in_use(&block.inode[i_number])){
+		return block.inode[i_number].size;
+	}
+	else{
+		return -1;
+	}
+}
+
+int fs_getsize( int inumber )
+{
+	pthread_rwlock_rdlock(&FS_LOCK);
+	int result = do_getsize(inumber);
+	pthread_rwlock_unlock(&FS_LOCK);
+	return result;
+}
+
+//------------------------------------------------Compressed Files-------------------------------------------------
+
+struct block_map {
+	int inumber;
+	struct fs_inode inode;
+	union fs_block indirect;
+	int indirect_loaded;
+	int indirect_dirty;
+};
+
+static void map_open( struct block_map *m, int inumber, struct fs_inode *inode )
+{
+	m->inumber = inumber;
+	m->inode = *inode;
+	m->indirect_loaded = 0;
+	m->indirect_dirty = 0;
+}
+
+static int map_load_indirect( struct block_map *m )
+{
+	if (m->indirect_loaded) return 1;
+	if (!is_data_block(m->inode.indirect)) return 0;
+	if (!block_read(m->inode.indirect, m->indirect.data)) return 0;
+	m->indirect_loaded = 1;
+	return 1;
+}
+
+static int map_get( struct block_map *m, int logical, int *pointer )
+/*
+Looks up the pointer in slot logical of the file's block map.  Returns zero if the indirect
+block holding it cannot be read.
+*/
+{
+	if (logical < POINTERS_PER_INODE){
+		*pointer = m->inode.direct[logical];
+		return 1;
+	}
+	if (m->inode.indirect == 0){
+		*pointer = 0;
+		return 1;
+	}
+	if (!map_load_indirect(m)) return 0;
+	*pointer = m->indirect.pointers[logical - POINTERS_PER_INODE];
+	return 1;
+}
+
+static int map_need_indirect( struct block_map *m )
+/*
+Makes sure the file has an indirect block, allocating an empty one if it has none.  Returns
+zero if the disk is full or the indirect block cannot be read.
+*/
+{
+	if (m->inode.indirect == 0){
+		int new_indirect_num = get_free_block();
+		if (new_indirect_num == 0) return 0;
+		block_mark_used(new_indirect_num);
+		memset(m->indirect.data, 0, DISK_BLOCK_SIZE);
+		m->inode.indirect = new_indirect_num;
+		m->indirect_loaded = 1;
+		m->indirect_dirty = 1;
+	}
+	return map_load_indirect(m);
+}
+
+static int map_set( struct block_map *m, int logical, int pointer )
+/*
+Stores pointer in slot logical of the file's block map.  Returns zero if the slot is in an
+indirect block that does not exist or cannot be read.
+*/
+{
+	if (logical < POINTERS_PER_INODE){
+		m->inode.direct[logical] = pointer;
+		return 1;
+	}
+	if (m->inode.indirect == 0 && pointer == 0) return 1;
+	if (!map_load_indirect(m)) return 0;
+	m->indirect.pointers[logical - POINTERS_PER_INODE] = pointer;
+	m->indirect_dirty = 1;
+	return 1;
+}
+
+static void map_close( struct block_map *m )
+/*
+Writes back the indirect block, if it changed, and the inode.
+*/
+{
+	if (m->indirect_dirty){
+		block_write(m->inode.indirect, m->indirect.data);
+		m->indirect_dirty = 0;
+	}
+	inode_save(m->inumber, &m->inode);
+}
+
+static int cluster_length( int size, int cluster )
+/*
+Returns how many bytes of a file of the given size fall in the cluster.
+*/
+{
+	int length = size - cluster * CLUSTER_SIZE;
+	if (length < 0) return 0;
+	if (length > CLUSTER_SIZE) return CLUSTER_SIZE;
+	return length;
+}
+
+static const char *cluster_get( struct block_map *m, int cluster )
+/*
+Returns the decompressed contents of one cluster of a compressed file.  A cluster whose
+slots all hold block pointers is stored raw; otherwise its first blocks hold a byte count
+followed by the compressed stream.  Returns zero if the cluster cannot be read.
+*/
+{
+	static char stream[CLUSTER_SIZE];
+	int phys[CLUSTER_BLOCKS];
+	int length = cluster_length(m->inode.size, cluster);
+	int nslots = (length + DISK_BLOCK_SIZE - 1) / DISK_BLOCK_SIZE;
+	int i, n = 0;
+
+	if (cluster_cache.inumber == m->inumber && cluster_cache.cluster == cluster){
+		return cluster_cache.data;
+	}
+	cluster_cache.inumber = 0;
+
+	for (i = 0; i < nslots; i++){
+		int pointer;
+		if (!map_get(m, cluster * CLUSTER_BLOCKS + i, &pointer)) return 0;
+		if (pointer == BLOCK_COMPRESSED) continue;
+		if (!is_data_block(pointer)){
+			printf("inode %d has an invalid block pointer %d \n", m->inumber, pointer);
+			return 0;
+		}
+		phys[n++] = pointer;
+	}
+
+	if (n == nslots){
+		for (i = 0; i < n; i++){
+			if (!block_read(phys[i], cluster_cache.data + i * DISK_BLOCK_SIZE)) return 0;
+		}
+	}
+	else{
+		int clen;
+		for (i = 0; i < n; i++){
+			if (!block_read(phys[i], stream + i * DISK_BLOCK_SIZE)) return 0;
+		}
+		memcpy(&clen, stream, sizeof(clen));
+		if (n == 0 || clen <= 0 || clen > n * DISK_BLOCK_SIZE - (int)sizeof(clen) ||
+		    lz_decompress(stream + sizeof(clen), clen, cluster_cache.data, CLUSTER_SIZE) != length){
+			printf("inode %d has a corrupt compressed cluster %d \n", m->inumber, cluster);
+			return 0;
+		}
+	}
+
+	cluster_cache.inumber = m->inumber;
+	cluster_cache.cluster = cluster;
+	return cluster_cache.data;
+}
+
+static int cluster_put( struct block_map *m, int cluster, const char *data, int length )
+/*
+Compresses length bytes into one cluster of a compressed file, reusing the cluster's blocks
+where it can and releasing any it no longer needs.  The cluster is stored raw when
+compressing it would not save a block.  Returns zero if the disk is full.
+*/
+{
+	static char stream[CLUSTER_SIZE];
+	int phys[CLUSTER_BLOCKS];
+	int shared[CLUSTER_BLOCKS];
+	int nshared = 0;
+	int nslots = (length + DISK_BLOCK_SIZE - 1) / DISK_BLOCK_SIZE;
+	int first = cluster * CLUSTER_BLOCKS;
+	int last = first + CLUSTER_BLOCKS;
+	int i, nold = 0, n = nslots;
+	const char *source = data;
+
+	if (last > POINTERS_PER_INODE + POINTERS_PER_BLOCK){
+		last = POINTERS_PER_INODE + POINTERS_PER_BLOCK;
+	}
+
+	if (nslots > 1){
+		int clen = lz_compress(data, length, stream + sizeof(clen), (nslots - 1) * DISK_BLOCK_SIZE - sizeof(clen));
+		if (clen > 0){
+			memcpy(stream, &clen, sizeof(clen));
+			n = (clen + sizeof(clen) + DISK_BLOCK_SIZE - 1) / DISK_BLOCK_SIZE;
+			memset(stream + sizeof(clen) + clen, 0, n * DISK_BLOCK_SIZE - sizeof(clen) - clen);
+			source = stream;
+		}
+	}
+
+	// Set up the indirect block first, so updating the block map below cannot fail.  One
+	// shared with a clone is copied before any of its pointers is looked at.
+	if (first + nslots > POINTERS_PER_INODE && !map_need_indirect(m)) return 0;
+	if (last > POINTERS_PER_INODE && block_shared(m->inode.indirect)){
+		if (!map_load_indirect(m)) return 0;
+		if (!indirect_unshare(&m->inode.indirect, &m->indirect)) return 0;
+	}
+
+	// Keep the blocks the cluster already has, in order, and allocate the rest.  Blocks
+	// shared with another file are left alone and replaced.
+	for (i = first; i < last; i++){
+		int pointer;
+		if (!map_get(m, i, &pointer)) return 0;
+		if (is_data_block(pointer)){
+			if (block_shared(pointer)) shared[nshared++] = pointer;
+			else phys[nold++] = pointer;
+		}
+	}
+	for (i = nold; i < n; i++){
+		phys[i] = get_free_block();
+		if (phys[i] == 0){
+			while (--i >= nold) block_mark_free(phys[i]);
+			return 0;
+		}
+		block_mark_used(phys[i]);
+	}
+
+	for (i = 0; i < n; i++){
+		dedup_forget(phys[i]);
+		if (source == data && (i + 1) * DISK_BLOCK_SIZE > length){
+			// Pad the tail of a raw cluster out to a whole block
+			union fs_block tail;
+			memset(tail.data, 0, DISK_BLOCK_SIZE);
+			memcpy(tail.data, data + i * DISK_BLOCK_SIZE, length - i * DISK_BLOCK_SIZE);
+			block_write(phys[i], tail.data);
+		}
+		else{
+			block_write(phys[i], source + i * DISK_BLOCK_SIZE);
+		}
+	}
+
+	for (i = first; i < last; i++){
+		int slot = i - first;
+		map_set(m, i, slot < n ? phys[slot] : slot < nslots ? BLOCK_COMPRESSED : 0);
+	}
+	for (i = n; i < nold; i++){
+		block_release(phys[i]);
+	}
+	for (i = 0; i < nshared; i++){
+		block_release(shared[i]);
+	}
+
+	memcpy(cluster_cache.data, data, length);
+	cluster_cache.inumber = m->inumber;
+	cluster_cache.cluster = cluster;
+	return 1;
+}
+
+static int read_compressed( int inumber, struct fs_inode *inode, char *data, int length, int offset )
+{
+	struct block_map m;
+	int data_read_so_far = 0;
+
+	map_open(&m, inumber, inode);
+	while (data_read_so_far < length){
+		int position = offset + data_read_so_far;
+		int cluster = position / CLUSTER_SIZE;
+		int within = position % CLUSTER_SIZE;
+		int r_size = cluster_length(inode->size, cluster) - within;
+		if (r_size > length - data_read_so_far){
+			r_size = length - data_read_so_far;
+		}
+
+		const char *contents = cluster_get(&m, cluster);
+		if (!contents) break;
+		memcpy(data + data_read_so_far, contents + within, r_size);
+		data_read_so_far = data_read_so_far + r_size;
+	}
+	return data_read_so_far;
+}
+
+static int write_compressed( int inumber, struct fs_inode *inode, const char *data, int length, int offset )
+/*
+Writes to a compressed file one cluster at a time.  A cluster only partly covered by the
+write is decompressed first so the bytes around the write are kept.  The inode is written
+once at the end.
+*/
+{
+	static char buffer[CLUSTER_SIZE];
+	struct block_map m;
+	int data_written = 0;
+
+	map_open(&m, inumber, inode);
+	while (data_written < length){
+		int position = offset + data_written;
+		int cluster = position / CLUSTER_SIZE;
+		int within = position % CLUSTER_SIZE;
+		int w_size = CLUSTER_SIZE - within;
+		if (w_size > length - data_written){
+			w_size = length - data_written;
+		}
+
+		int old_length = cluster_length(m.inode.size, cluster);
+		int new_length = within + w_size > old_length ? within + w_size : old_length;
+		if (within > 0 || within + w_size < old_length){
+			const char *contents = cluster_get(&m, cluster);
+			if (!contents) break;
+			memcpy(buffer, contents, old_length);
+		}
+		memcpy(buffer + within, data + data_written, w_size);
+
+		if (!cluster_put(&m, cluster, buffer, new_length)) break;
+		data_written = data_written + w_size;
+
+		if (position + w_size > m.inode.size){
+			m.inode.size = position + w_size;
+		}
+	}
+
+	map_close(&m);
+	metadata_flush();
+	return data_written;
+}
+
+static int do_compress( int inumber, int enable )
+/*
+Turns transparent compression on or off for an empty file.  Returns one on success and
+zero on failure.
+*/
+{
+	struct fs_inode inode;
+
+	if (IS_MOUNTED == 0){
+		printf("disk not yet mounted \n");
+		return 0;
+	}
+	if (!is_valid_inumber(inumber) || INODE_BITMAP[inumber] == 0){
+		printf("%d is not a valid inode \n", inumber);
+		return 0;
+	}
+
+	inode_load(inumber, &inode);
+	if (inode.size != 0){
+		printf("inode %d is not empty, compression can only be changed on an empty file \n", inumber);
+		return 0;
+	}
+	inode.isvalid = enable ? (INODE_VALID | INODE_COMPRESSED) : INODE_VALID;
+	inode_save(inumber, &inode);
+	return 1;
+}
+
+int fs_compress( int inumber, int enable )
+{
+	pthread_rwlock_wrlock(&FS_LOCK);
+	int result = inode_is_directory(inumber) ? 0 : do_compress(inumber, enable);
+	pthread_rwlock_unlock(&FS_LOCK);
+	return result;
+}
+
+//------------------------------------------------Reading and Writing----------------------------------------------
+
+#define VECTOR_BLOCKS 64
+
+struct iov_cursor {
+	const struct iovec *iov;
+	int iovcnt;
+	int seg;
+	size_t off;
+};
+
+static int iov_length( const struct iovec *iov, int iovcnt )
+/*
+Returns the total length of a scatter-gather list, or -1 if the list is malformed or too
+long to address.
+*/
+{
+	long long total = 0;
+	int i;
+
+	if (iovcnt < 0 || (iovcnt > 0 && !iov)) return -1;
+	for (i = 0; i < iovcnt; i++){
+		if (iov[i].iov_len > INT_MAX) return -1;
+		total = total + iov[i].iov_len;
+		if (total > INT_MAX) return -1;
+	}
+	return total;
+}
+
+static void iov_start( struct iov_cursor *c, const struct iovec *iov, int iovcnt )
+{
+	c->iov = iov;
+	c->iovcnt = iovcnt;
+	c->seg = 0;
+	c->off = 0;
+}
+
+static char *iov_span( struct iov_cursor *c, int n )
+/*
+Returns where the next n bytes of the list are if they all lie in one segment, otherwise zero.
+*/
+{
+	while (c->seg < c->iovcnt && c->off == c->iov[c->seg].iov_len){
+		c->seg++;
+		c->off = 0;
+	}
+	if (c->seg == c->iovcnt || c->iov[c->seg].iov_len - c->off < (size_t)n) return 0;
+	return (char *)c->iov[c->seg].iov_base + c->off;
+}
+
+static void iov_move( struct iov_cursor *c, char *buffer, int n, int to_list )
+/*
+Copies the next n bytes of the list into buffer, or out of buffer into the list if to_list is
+set, and moves the cursor past them.  With a null buffer the bytes are only skipped.
+*/
+{
+	while (n > 0){
+		size_t chunk = c->iov[c->seg].iov_len - c->off;
+		if (chunk == 0){
+			c->seg++;
+			c->off = 0;
+			continue;
+		}
+		if (chunk > (size_t)n) chunk = n;
+		char *place = (char *)c->iov[c->seg].iov_base + c->off;
+		if (buffer){
+			if (to_list) memcpy(place, buffer, chunk);
+			else memcpy(buffer, place, chunk);
+			buffer = buffer + chunk;
+		}
+		c->off = c->off + chunk;
+		n = n - chunk;
+	}
+}
+
+static int do_readv( int inumber, const struct iovec *iov, int iovcnt, int offset )
+/*
+Read data from a valid inode into a scatter-gather list, filling each buffer in turn, starting 
+at "offset" in the inode. The block map is looked up once and the blocks are handed to the disk 
+layer up to VECTOR_BLOCKS at a time. A whole block that lands in one buffer is read straight 
+into it; the rest pass through a bounce buffer. Return the total number of bytes read, which 
+is short if the end of the inode is reached. If the given inumber is invalid, or any other 
+error is encountered, return 0.
+*/
+{
+	static __thread union fs_block bounce[VECTOR_BLOCKS];
+	int blocknums[VECTOR_BLOCKS];
+	char *buffers[VECTOR_BLOCKS];
+	struct iov_cursor plan, copy;
+	struct block_map m;
+	int i;
+
+	if (IS_MOUNTED == 0){
+		printf("file system has not yet been mounted. \n");
+		return 0;
+	}
+
+	// Check if it's valid
+	if (!is_valid_inumber(inumber) || INODE_BITMAP[inumber] == 0){
+		printf("error in reading.  invalid number.");
+		return 0;
+	}
+
+	int length = iov_length(iov, iovcnt);
+	struct fs_inode inode;
+	inode_load(inumber, &inode);
+
+	// If the length will put you off the end of the inode, stop at the end
+	if (offset < 0 || length <= 0 || offset >= inode.size){
+		return 0;
+	}
+	if (length > inode.size - offset){
+		length = inode.size - offset;
+	}
+	if (inode.isvalid & INODE_COMPRESSED){
+		// Clusters are decompressed into a cache, so reading buffer by buffer costs no extra I/O
+		int data_read_so_far = 0;
+		pthread_mutex_lock(&CLUSTER_LOCK);
+		for (i = 0; i < iovcnt && data_read_so_far < length; i++){
+			int r_size = iov[i].iov_len;
+			if (r_size > length - data_read_so_far){
+				r_size = length - data_read_so_far;
+			}
+			if (r_size == 0) continue;
+			int actual = read_compressed(inumber, &inode, iov[i].iov_base, r_size, offset + data_read_so_far);
+			data_read_so_far = data_read_so_far + actual;
+			if (actual < r_size) break;
+		}
+		pthread_mutex_unlock(&CLUSTER_LOCK);
+		return data_read_so_far;
+	}
+
+	map_open(&m, inumber, &inode);
+	iov_start(&plan, iov, iovcnt);
+	iov_start(&copy, iov, iovcnt);
+
+	int data_read_so_far = 0;
+	while (data_read_so_far < length){
+		// Look up the next batch of blocks
+		int n = 0, planned = data_read_so_far, failed = 0;
+		while (n < VECTOR_BLOCKS && planned < length){
+			int position = offset + planned;
+			int within = position % DISK_BLOCK_SIZE;
+			int r_size = DISK_BLOCK_SIZE - within;
+			if (r_size > length - planned){
+				r_size = length - planned;
+			}
+
+			int pointer;
+			if (!map_get(&m, position / DISK_BLOCK_SIZE, &pointer)){
+				failed = 1;
+				break;
+			}
+			if (!is_data_block(pointer)){
+				printf("inode %d has an invalid block pointer %d \n", inumber, pointer);
+				failed = 1;
+				break;
+			}
+			blocknums[n] = pointer;
+			buffers[n] = r_size == DISK_BLOCK_SIZE ? iov_span(&plan, DISK_BLOCK_SIZE) : 0;
+			if (!buffers[n]) buffers[n] = bounce[n].data;
+			iov_move(&plan, 0, r_size, 0);
+			planned = planned + r_size;
+			n++;
+		}
+
+		// Read them, then copy out whatever went through a bounce buffer
+		int intact = blocks_read(blocknums, buffers, n);
+		for (i = 0; i < intact; i++){
+			int position = offset + data_read_so_far;
+			int within = position % DISK_BLOCK_SIZE;
+			int r_size = DISK_BLOCK_SIZE - within;
+			if (r_size > length - data_read_so_far){
+				r_size = length - data_read_so_far;
+			}
+			iov_move(&copy, buffers[i] == bounce[i].data ? bounce[i].data + within : 0, r_size, 1);
+			data_read_so_far = data_read_so_far + r_size;
+		}
+		if (failed || intact < n) break;
+	}
+	return data_read_so_far;
+}
+
+static int do_read( int inumber, char *data, int length, int offset )
+/*
+Read data from a valid inode. Copy "length" bytes from the inode into the "data" pointer, 
+starting at "offset" in the inode. Return the total number of bytes read. The number of bytes 
+actually read could be smaller than the number of bytes requested, perhaps if the end of the 
+inode is reached. If the given inumber is invalid, or any other error is encountered, return 0.
+*/
+{
+	struct iovec iov;
+	if (length <= 0) return 0;
+	iov.iov_base = data;
+	iov.iov_len = length;
+	return do_readv(inumber, &iov, 1, offset);
+}
+
+int fs_read( int inumber, char *data, int length, int offset )
+{
+	struct stats_timer t;
+	int caller = disk_trace_caller(TRACE_CALLER_READ);
+	stats_begin(&t);
+	pthread_rwlock_rdlock(&FS_LOCK);
+	int result = do_read(inumber, data, length, offset);
+	pthread_rwlock_unlock(&FS_LOCK);
+	stats_end(&t, STATS_FS_READ, result);
+	disk_trace_caller(caller);
+	return result;
+}
+
+int fs_readv( int inumber, const struct iovec *iov, int iovcnt, int offset )
+{
+	struct stats_timer t;
+	int caller = disk_trace_caller(TRACE_CALLER_READ);
+	stats_begin(&t);
+	pthread_rwlock_rdlock(&FS_LOCK);
+	int result = do_readv(inumber, iov, iovcnt, offset);
+	pthread_rwlock_unlock(&FS_LOCK);
+	stats_end(&t, STATS_FS_READ, result);
+	disk_trace_caller(caller);
+	return result;
+}
+
+static int do_writev( int inumber, const struct iovec *iov, int iovcnt, int offset )
+/*
+Write the buffers of a scatter-gather list, one after another, to a valid inode starting at 
+"offset" bytes. The block map is held in memory for the whole call, the data blocks are handed 
+to the disk layer up to VECTOR_BLOCKS at a time, and the indirect block and the inode are 
+written once at the end. Return the number of bytes actually written, which could be smaller 
+than requested if the disk becomes full. If the given inumber is invalid, or any other error 
+is encountered, return 0.
+*/
+{
+	static union fs_block bounce[VECTOR_BLOCKS];
+	int blocknums[VECTOR_BLOCKS];
+	const char *buffers[VECTOR_BLOCKS];
+	unsigned int hashes[VECTOR_BLOCKS];
+	struct iov_cursor c;
+	struct block_map m;
+	int i;
+
+	// Check if it's been mounted
+	if (IS_MOUNTED == 0){
+		printf("file system has not yet been mounted. \n");
+		return 0;
+	}
+
+	// Check if it's a valid inode
+	if (!is_valid_inumber(inumber) || INODE_BITMAP[inumber] == 0){
+		printf("error in writing.  invalid number. \n");
+		return 0;
+	}
+
+	// Load the inode
+	int length = iov_length(iov, iovcnt);
+	struct fs_inode inode;
+	inode_load(inumber, &inode);
+
+	// Writes may overwrite or extend the file, but may not leave a hole
+	if (offset < 0 || offset > inode.size || length <= 0){
+		return 0;
+	}
+	if (length > FS_MAX_FILE_SIZE - offset){
+		length = FS_MAX_FILE_SIZE - offset;
+	}
+	iov_start(&c, iov, iovcnt);
+	if (inode.isvalid & INODE_COMPRESSED){
+		// Clusters are compressed whole, so gather the buffers into one first
+		char *data = malloc(length);
+		if (!data) return 0;
+		iov_move(&c, data, length, 0);
+		int result = write_compressed(inumber, &inode, data, length, offset);
+		free(data);
+		return result;
+	}
+
+	map_open(&m, inumber, &inode);
+	int data_written = 0, full = 0, indirect_ready = 0;
+	while (data_written < length && !full){
+		int n = 0, batched = data_written;
+		while (n < VECTOR_BLOCKS && batched < length){
+			int position = offset + batched;
+			int logical = position / DISK_BLOCK_SIZE;
+			int within = position % DISK_BLOCK_SIZE;
+			int w_size = DISK_BLOCK_SIZE - within;
+			if (w_size > length - batched){
+				w_size = length - batched;
+			}
+
+			//-------------------------------------------Find the block----------------------------------------------
+			// The first time the write reaches the indirect block, set it up, copying one
+			// shared with a clone, so that the block map can be changed in memory
+			if (logical >= POINTERS_PER_INODE && !indirect_ready){
+				if (!map_need_indirect(&m) || !indirect_unshare(&m.inode.indirect, &m.indirect)){
+					full = 1;
+					break;
+				}
+				indirect_ready = 1;
+			}
+			int pointer;
+			map_get(&m, logical, &pointer);
+
+			// A whole block that lies in one buffer is written straight from it
+			const char *source = w_size == DISK_BLOCK_SIZE ? iov_span(&c, DISK_BLOCK_SIZE) : 0;
+			if (source){
+				iov_move(&c, 0, w_size, 0);
+			}
+			else{
+				if (w_size < DISK_BLOCK_SIZE){
+					if (pointer == 0){
+						memset(bounce[n].data, 0, DISK_BLOCK_SIZE);
+					}
+					else if (!block_read(pointer, bounce[n].data)){	// Keep the part of the block not being written
+						full = 1;
+						break;
+					}
+				}
+				iov_move(&c, bounce[n].data + within, w_size, 0);
+				source = bounce[n].data;
+			}
+
+			//-------------------------------------------Share a duplicate block--------------------------------------
+			unsigned int hash = 0;
+			int match = 0;
+			if (DEDUP_INDEX && w_size == DISK_BLOCK_SIZE){
+				hash = dedup_hash(source);
+				match = dedup_find(source, hash);
+				if (match != 0 && match != pointer){
+					block_share(match);
+					if (pointer != 0) block_release(pointer);
+					map_set(&m, logical, match);
+				}
+			}
+
+			//-------------------------------------------Queue the block----------------------------------------------
+			if (match == 0){
+				// A block shared with another file is copied rather than changed in place
+				if (pointer == 0 || block_shared(pointer)){
+					int fresh = get_free_block();		// Get a new block
+					if (fresh == 0){			// There are no more free blocks
+						full = 1;
+						break;
+					}
+					block_mark_used(fresh);		// You're going to use that block, so mark it in use
+					map_set(&m, logical, fresh);		// Add that new block to the block map
+					if (pointer != 0) block_release(pointer);
+					pointer = fresh;
+				}
+				else{
+					dedup_forget(pointer);			// Its contents are about to change
+				}
+				blocknums[n] = pointer;
+				buffers[n] = source;
+				hashes[n] = hash;
+				n++;
+			}
+			batched = batched + w_size;
+			if (position + w_size > m.inode.size){
+				m.inode.size = position + w_size;	// Update the size of the inode
+			}
+		}
+
+		//-------------------------------------------Write the batch----------------------------------------------
+		blocks_write(blocknums, buffers, n);
+		for (i = 0; i < n; i++){
+			if (hashes[i] != 0) dedup_insert(blocknums[i], hashes[i]);
+		}
+		data_written = batched;
+	}
+
+	// Give back a new indirect block if the disk filled up before anything went in it
+	if (inode.indirect == 0 && m.inode.indirect != 0 && m.inode.size <= POINTERS_PER_INODE * DISK_BLOCK_SIZE){
+		block_mark_free(m.inode.indirect);
+		m.inode.indirect = 0;
+		m.indirect_dirty = 0;
+	}
+	map_close(&m);					// Write the block map and the inode back to disk
+	metadata_flush();
+	return data_written;
+}
+
+static int do_write( int inumber, const char *data, int length, int offset )
+/*
+Write data to a valid inode. Copy "length" bytes from the pointer "data" into the inode 
+starting at "offset" bytes. Allocate any necessary direct and indirect blocks in the process. 
+Return the number of bytes actually written. The number of bytes actually written could be 
+smaller than the number of bytes request, perhaps if the disk becomes full. If the given 
+inumber is invalid, or any other error is encountered, return 0.
+*/
+{
+	struct iovec iov;
+	if (length <= 0) return 0;
+	iov.iov_base = (char *)data;
+	iov.iov_len = length;
+	return do_writev(inumber, &iov, 1, offset);
+}
+
+int fs_write( int inumber, const char *data, int length, int offset )
+{
+	struct stats_timer t;
+	int caller = disk_trace_caller(TRACE_CALLER_WRITE);
+	stats_begin(&t);
+	pthread_rwlock_wrlock(&FS_LOCK);
+	int result = inode_is_directory(inumber) ? 0 : do_write(inumber, data, length, offset);
+	pthread_rwlock_unlock(&FS_LOCK);
+	stats_end(&t, STATS_FS_WRITE, result);
+	disk_trace_caller(caller);
+	return result;
+}
+
+int fs_writev( int inumber, const struct iovec *iov, int iovcnt, int offset )
+{
+	struct stats_timer t;
+	int caller = disk_trace_caller(TRACE_CALLER_WRITE);
+	stats_begin(&t);
+	pthread_rwlock_wrlock(&FS_LOCK);
+	int result = inode_is_directory(inumber) ? 0 : do_writev(inumber, iov, iovcnt, offset);
+	pthread_rwlock_unlock(&FS_LOCK);
+	stats_end(&t, STATS_FS_WRITE, result);
+	disk_trace_caller(caller);
+	return result;
+}
+
+//------------------------------------------------Truncate and Delete----------------------------------------------
+
+static int truncate_map( struct block_map *m, int newsize )
+/*
+Shrinks the file open in m to newsize bytes and releases every block past the new end in
+one batch.  Changes to the indirect block are made in memory and written once by map_close.
+If no slot in the indirect block is still needed, the indirect block is released whole.  The
+cluster a compressed file now ends in is compressed again at its new length.  Returns zero
+if a block cannot be read or the disk is full.  The caller closes m either way.
+*/
+{
+	static int release[POINTERS_PER_INODE + POINTERS_PER_BLOCK + 1];
+	int nslots = (m->inode.size + DISK_BLOCK_SIZE - 1) / DISK_BLOCK_SIZE;
+	int keep = (newsize + DISK_BLOCK_SIZE - 1) / DISK_BLOCK_SIZE;
+	int i, n = 0;
+
+	if (m->inode.isvalid & INODE_COMPRESSED){
+		static char buffer[CLUSTER_SIZE];
+		int cluster = newsize / CLUSTER_SIZE;
+		int length = newsize % CLUSTER_SIZE;
+		// The slots of the last cluster past its new length are cleared by cluster_put
+		if (length > 0){
+			const char *contents = cluster_get(m, cluster);
+			if (!contents) return 0;
+			memcpy(buffer, contents, length);
+			if (!cluster_put(m, cluster, buffer, length)) return 0;
+		}
+	}
+
+	// Collect the blocks in the indirect block first, so nothing changes if it cannot be read
+	if (is_data_block(m->inode.indirect)){
+		if (keep <= POINTERS_PER_INODE){
+			// Unless a clone still shares the indirect block, and with it everything
+			// behind it, every block it points to goes too
+			if (!block_shared(m->inode.indirect)){
+				if (!map_load_indirect(m)) return 0;
+				for (i = 0; i < POINTERS_PER_BLOCK; i++){
+					if (is_data_block(m->indirect.pointers[i])) release[n++] = m->indirect.pointers[i];
+				}
+			}
+			release[n++] = m->inode.indirect;
+			m->inode.indirect = 0;
+			m->indirect_loaded = 0;
+			m->indirect_dirty = 0;
+		}
+		else if (keep < nslots){
+			if (!map_load_indirect(m)) return 0;
+			if (!indirect_unshare(&m->inode.indirect, &m->indirect)) return 0;
+			for (i = keep - POINTERS_PER_INODE; i < POINTERS_PER_BLOCK; i++){
+				if (m->indirect.pointers[i] == 0) continue;
+				if (is_data_block(m->indirect.pointers[i])) release[n++] = m->indirect.pointers[i];
+				m->indirect.pointers[i] = 0;
+				m->indirect_dirty = 1;
+			}
+		}
+	}
+
+	for (i = keep; i < POINTERS_PER_INODE; i++){
+		if (is_data_block(m->inode.direct[i])) release[n++] = m->inode.direct[i];
+		m->inode.direct[i] = 0;
+	}
+
+	blocks_release(release, n);
+	m->inode.size = newsize;
+	return 1;
+}
+
+static int do_truncate( int inumber, int newsize )
+/*
+Shrinks a file to newsize bytes, releasing the blocks past its new end.  A file cannot be
+grown this way, since that would leave a hole.  Returns one on success and zero on failure.
+*/
+{
+	struct fs_inode inode;
+	struct block_map m;
+
+	if (IS_MOUNTED == 0){
+		printf("disk not yet mounted \n");
+		return 0;
+	}
+	if (!is_valid_inumber(inumber) || INODE_BITMAP[inumber] == 0){
+		printf("%d is not a valid inode to truncate \n", inumber);
+		return 0;
+	}
+
+	inode_load(inumber, &inode);
+	if (newsize < 0 || newsize > inode.size){
+		printf("inode %d is %d bytes and cannot be truncated to %d \n", inumber, inode.size, newsize);
+		return 0;
+	}
+	if (newsize == inode.size) return 1;
+
+	map_open(&m, inumber, &inode);
+	int result = truncate_map(&m, newsize);
+	map_close(&m);
+	cluster_cache_drop(inumber);
+	metadata_flush();
+	return result;
+}
+
+int fs_truncate( int inumber, int newsize )
+{
+	struct stats_timer t;
+	int caller = disk_trace_caller(TRACE_CALLER_DELETE);
+	stats_begin(&t);
+	pthread_rwlock_wrlock(&FS_LOCK);
+	int result = inode_is_directory(inumber) ? 0 : do_truncate(inumber, newsize);
+	pthread_rwlock_unlock(&FS_LOCK);
+	stats_end(&t, STATS_FS_TRUNCATE, 0);
+	disk_trace_caller(caller);
+	return result;
+}
+
+static int do_delete( int inumber )
+/* Delete the inode indicated by the inumber. Release all data and indirect blocks assigned to this 
+inode and return them to the free block map. On success, return one. On failure, return 0.
+*/
+{
+	if (IS_MOUNTED == 0){
+		printf("disk not yet mounted \n");
+		return 0;
+	}
+
+	if (inumber <= 0 || inumber >= SUPERBLOCK.ninodes){
+		printf("%d is not a valid inode to delete \n", inumber);
+		return 0;
+	}
+
+	// Convert the numbers
+	int block_number = inumber/INODES_PER_BLOCK + 1;
+	int i_number = inumber % INODES_PER_BLOCK;
+
+	
+	// Read the block
+	union fs_block block;
+	disk_read(block_number, block.data);
+
+
+	if (inode_in_use(&block.inode[i_number])){
+		// Truncate the file to nothing, which releases all its blocks at once.  Emptying a
+		// file never recompresses a cluster, so this only fails before anything changes.
+		struct block_map m;
+		map_open(&m, inumber, &block.inode[i_number]);
+		if (!truncate_map(&m, 0)){
+			printf("inode %d could not be deleted \n", inumber);
+			return 0;
+		}
+
+		// Set the isvalid to 0
+		block.inode[i_number] = m.inode;
+		block.inode[i_number].isvalid = 0;
+		cluster_cache_drop(inumber);
+		inode_mark_free(inumber);
+
+		// Write the block back to the disk
+		disk_write(block_number, block.data);
+		metadata_flush();
+
+		return 1;
+		
+	}
+	printf("%d is not a valid inode to delete \n", inumber);
+	return 0;
+	
+}
+
+int fs_delete( int inumber )
+{
+	struct stats_timer t;
+	int caller = disk_trace_caller(TRACE_CALLER_DELETE);
+	stats_begin(&t);
+	pthread_rwlock_wrlock(&FS_LOCK);
+	int result = inode_is_directory(inumber) ? 0 : do_delete(inumber);
+	pthread_rwlock_unlock(&FS_LOCK);
+	stats_end(&t, STATS_FS_DELETE, 0);
+	disk_trace_caller(caller);
+	return result;
+}
+
+//------------------------------------------------Directory--------------------------------------------------------
+
+static unsigned int dir_hash( const char *name )
+{
+	return crc32c(0, name, strlen(name));
+}
+
+static int dir_name_ok( const char *name )
+{
+	size_t length = strlen(name);
+	if (length == 0 || length > DIR_NAME_MAX){
+		printf("names must be 1 to %d characters long \n", DIR_NAME_MAX);
+		return 0;
+	}
+	return 1;
+}
+
+static int dir_load()
+/*
+Reads the root directory's table into memory.  A filesystem without a root directory loads
+as an empty one.  Returns one on success and zero if the table is damaged or unreadable.
+*/
+{
+	struct fs_inode inode;
+	int depth;
+
+	free(DIR_TABLE);
+	DIR_TABLE = 0;
+	DIR_DEPTH = 0;
+	if (SUPERBLOCK.root == 0) return 1;
+
+	if (!is_valid_inumber(SUPERBLOCK.root) || INODE_BITMAP[SUPERBLOCK.root] != DIRECTORY_INODE) return 0;
+	inode_load(SUPERBLOCK.root, &inode);
+	for (depth = 0; depth <= DIR_MAX_DEPTH; depth++){
+		if (inode.size == (int)sizeof(int) << depth) break;
+	}
+	if (depth > DIR_MAX_DEPTH) return 0;
+
+	int *table = malloc(inode.size);
+	if (!table) return 0;
+	if (do_read(SUPERBLOCK.root, (char *)table, inode.size, 0) != inode.size){
+		free(table);
+		return 0;
+	}
+	DIR_TABLE = table;
+	DIR_DEPTH = depth;
+	return 1;
+}
+
+static int dir_new_inode()
+/*
+Creates an empty inode for the root directory's own use, marked so that the per-inode calls
+refuse it.  Returns its inumber, or zero if the inode table is full.
+*/
+{
+	struct fs_inode inode;
+	int inumber = do_create();
+
+	if (inumber == 0) return 0;
+	inode_load(inumber, &inode);
+	inode.isvalid = INODE_VALID | INODE_DIRECTORY;
+	inode_save(inumber, &inode);
+	INODE_BITMAP[inumber] = DIRECTORY_INODE;
+	return inumber;
+}
+
+static int dir_create()
+/*
+Makes the root directory: a table of one entry, leading to one empty bucket, and records it
+in the superblock.  Returns one on success and zero on failure.
+*/
+{
+	union fs_block block;
+	int root, bucket;
+	int *table = malloc(sizeof(int));
+
+	if (!table) return 0;
+	root = dir_new_inode();
+	bucket = root ? dir_new_inode() : 0;
+	if (bucket == 0){
+		printf("not enough inodes for the root directory \n");
+		if (root) do_delete(root);
+		free(table);
+		return 0;
+	}
+
+	memset(block.data, 0, DISK_BLOCK_SIZE);
+	table[0] = bucket;
+	if (do_write(bucket, block.data, DISK_BLOCK_SIZE, 0) != DISK_BLOCK_SIZE ||
+	    do_write(root, (char *)table, sizeof(int), 0) != sizeof(int)){
+		printf("not enough space for the root directory \n");
+		do_delete(bucket);
+		do_delete(root);
+		free(table);
+		return 0;
+	}
+
+	disk_read(0, block.data);
+	block.super.root = root;
+	disk_write(0, block.data);
+	SUPERBLOCK.root = root;
+
+	free(DIR_TABLE);
+	DIR_TABLE = table;
+	DIR_DEPTH = 0;
+	return 1;
+}
+
+static int dir_ready()
+/*
+Checks that the disk is mounted and that its root directory, if it has one, was loaded.
+*/
+{
+	if (IS_MOUNTED == 0){
+		printf("disk not yet mounted \n");
+		return 0;
+	}
+	if (SUPERBLOCK.root != 0 && !DIR_TABLE){
+		printf("the root directory could not be loaded \n");
+		return 0;
+	}
+	return 1;
+}
+
+static int dir_bucket_read( unsigned int hash, int *bucket, union fs_block *block )
+/*
+Reads the bucket that holds the names with the given hash.  Takes two block reads, one for
+the bucket's inode and one for its only block.
+*/
+{
+	*bucket = DIR_TABLE[hash & ((1u << DIR_DEPTH) - 1)];
+	return do_read(*bucket, block->data, DISK_BLOCK_SIZE, 0) == DISK_BLOCK_SIZE;
+}
+
+static int dir_find( struct dir_bucket *b, const char *name )
+{
+	int i;
+	for (i = 0; i < DIR_BUCKET_SLOTS; i++){
+		if (b->entry[i].inumber != 0 && strcmp(b->entry[i].name, name) == 0) return i;
+	}
+	return -1;
+}
+
+static int dir_grow()
+/*
+Doubles the table.  The new half is a copy of the old, so every bucket is reached from twice
+as many entries and no bucket has to change.
+*/
+{
+	int n = 1 << DIR_DEPTH;
+	int length = n * sizeof(int);
+	int *table = realloc(DIR_TABLE, 2 * length);
+
+	if (!table) return 0;
+	DIR_TABLE = table;
+	memcpy(table + n, table, length);
+	if (do_write(SUPERBLOCK.root, (char *)(table + n), length, length) != length){
+		do_truncate(SUPERBLOCK.root, length);
+		return 0;
+	}
+	DIR_DEPTH++;
+	return 1;
+}
+
+static int dir_split( int bucket, union fs_block *block )
+/*
+Splits a full bucket on the next bit of the hash.  The names with that bit set move to a new
+bucket, and the table entries that led to the old bucket and have that bit set are pointed
+at the new one.  Only the table blocks holding those entries are written.  Returns one on
+success and zero if the table cannot grow or there is no room for another bucket.
+*/
+{
+	struct dir_bucket *old = &block->bucket;
+	const int per_block = DISK_BLOCK_SIZE / sizeof(int);
+	union fs_block split;
+	int depth = old->depth;
+	int i, j;
+
+	if (depth == DIR_DEPTH && (DIR_DEPTH == DIR_MAX_DEPTH || !dir_grow())) return 0;
+
+	int new = dir_new_inode();
+	if (new == 0) return 0;
+
+	memset(split.data, 0, DISK_BLOCK_SIZE);
+	split.bucket.depth = depth + 1;
+	for (i = 0; i < DIR_BUCKET_SLOTS; i++){
+		struct dir_entry *e = &old->entry[i];
+		if (e->inumber != 0 && (dir_hash(e->name) >> depth) & 1){
+			split.bucket.entry[split.bucket.count++] = *e;
+			memset(e, 0, sizeof(*e));
+			old->count--;
+		}
+	}
+	old->depth = depth + 1;
+
+	// The old bucket is only rewritten once the new one is safely on disk
+	if (do_write(new, split.data, DISK_BLOCK_SIZE, 0) != DISK_BLOCK_SIZE ||
+	    do_write(bucket, block->data, DISK_BLOCK_SIZE, 0) != DISK_BLOCK_SIZE){
+		do_delete(new);
+		return 0;
+	}
+
+	int n = 1 << DIR_DEPTH;
+	for (i = 0; i < n; i += per_block){
+		int changed = 0;
+		int end = i + per_block < n ? i + per_block : n;
+		for (j = i; j < end; j++){
+			if (DIR_TABLE[j] == bucket && (j >> depth) & 1){
+				DIR_TABLE[j] = new;
+				changed = 1;
+			}
+		}
+		if (changed){
+			int length = (end - i) * sizeof(int);
+			do_write(SUPERBLOCK.root, (char *)(DIR_TABLE + i), length, i * sizeof(int));
+		}
+	}
+	return 1;
+}
+
+static int do_lookup( const char *name )
+/*
+Returns the inumber the root directory gives the name, or zero if the name is not there.
+The table is in memory, so a lookup reads only the bucket's inode and block.
+*/
+{
+	union fs_block block;
+	int bucket, i;
+
+	if (!dir_ready() || !dir_name_ok(name)) return 0;
+	if (!DIR_TABLE || !dir_bucket_read(dir_hash(name), &bucket, &block)) return 0;
+	i = dir_find(&block.bucket, name);
+	return i < 0 ? 0 : block.bucket.entry[i].inumber;
+}
+
+static int do_link( const char *name, int inumber )
+/*
+Adds the name to the root directory, leading to the given inode, and makes the root
+directory first if there is none yet.  A full bucket is split, doubling the table when the
+bucket already uses every bit of it.  Returns one on success and zero on failure, including
+when the name is already linked.
+*/
+{
+	union fs_block block;
+	unsigned int hash;
+	int bucket, i;
+
+	if (!dir_ready() || !dir_name_ok(name)) return 0;
+	if (!is_valid_inumber(inumber) || INODE_BITMAP[inumber] != 1){
+		printf("%d is not a valid inode to link \n", inumber);
+		return 0;
+	}
+	if (SUPERBLOCK.root == 0 && !dir_create()) return 0;
+
+	hash = dir_hash(name);
+	while (1){
+		if (!dir_bucket_read(hash, &bucket, &block)) return 0;
+		if (dir_find(&block.bucket, name) >= 0){
+			printf("%s is already linked \n", name);
+			return 0;
+		}
+		if (block.bucket.count < DIR_BUCKET_SLOTS) break;
+		if (!dir_split(bucket, &block)){
+			printf("the root directory is full \n");
+			return 0;
+		}
+	}
+
+	for (i = 0; block.bucket.entry[i].inumber != 0; i++);
+	block.bucket.entry[i].inumber = inumber;
+	strcpy(block.bucket.entry[i].name, name);
+	block.bucket.count++;
+	return do_write(bucket, block.data, DISK_BLOCK_SIZE, 0) == DISK_BLOCK_SIZE;
+}
+
+static int do_unlink( const char *name )
+/*
+Removes the name from the root directory.  The inode it led to is left as it is.  Buckets
+are not merged as they empty.  Returns one on success and zero if the name is not there.
+*/
+{
+	union fs_block block;
+	int bucket, i;
+
+	if (!dir_ready() || !dir_name_ok(name)) return 0;
+	if (!DIR_TABLE || !dir_bucket_read(dir_hash(name), &bucket, &block)) return 0;
+	i = dir_find(&block.bucket, name);
+	if (i < 0){
+		printf("%s is not linked \n", name);
+		return 0;
+	}
+	memset(&block.bucket.entry[i], 0, sizeof(struct dir_entry));
+	block.bucket.count--;
+	return do_write(bucket, block.data, DISK_BLOCK_SIZE, 0) == DISK_BLOCK_SIZE;
+}
+
+int fs_lookup( const char *name )
+{
+	struct stats_timer t;
+	int caller = disk_trace_caller(TRACE_CALLER_READ);
+	stats_begin(&t);
+	pthread_rwlock_rdlock(&FS_LOCK);
+	int result = do_lookup(name);
+	pthread_rwlock_unlock(&FS_LOCK);
+	stats_end(&t, STATS_FS_LOOKUP, 0);
+	disk_trace_caller(caller);
+	return result;
+}
+
+int fs_link( const char *name, int inumber )
+{
+	struct stats_timer t;
+	int caller = disk_trace_caller(TRACE_CALLER_WRITE);
+	stats_begin(&t);
+	pthread_rwlock_wrlock(&FS_LOCK);
+	int result = do_link(name, inumber);
+	pthread_rwlock_unlock(&FS_LOCK);
+	stats_end(&t, STATS_FS_LINK, 0);
+	disk_trace_caller(caller);
+	return result;
+}
+
+int fs_unlink( const char *name )
+{
+	struct stats_timer t;
+	int caller = disk_trace_caller(TRACE_CALLER_WRITE);
+	stats_begin(&t);
+	pthread_rwlock_wrlock(&FS_LOCK);
+	int result = do_unlink(name);
+	pthread_rwlock_unlock(&FS_LOCK);
+	stats_end(&t, STATS_FS_UNLINK, 0);
+	disk_trace_caller(caller);
+	return result;
+}
+
+//------------------------------------------------File System Check------------------------------------------------
+
+#define FSCK_MAX_THREADS 16
+#define FSCK_MAX_POINTERS (POINTERS_PER_INODE + POINTERS_PER_BLOCK)
+
+struct fsck_state {
+	struct fs_superblock super;
+	int data_start;
+	int repair;
+	int next_inode_block;		// Next inode block to hand out, claimed atomically by the workers
+	int *refcount;			// Number of references to each block
+	int *owner;			// Lowest inumber referencing each block
+	char *valid;			// One for each valid inode, DIRECTORY_INODE for the directory's own
+	int problems;
+	int duplicates;
+	int pass;
+};
+
+static int fsck_in_range( struct fsck_state *s, int blocknum )
+{
+	return blocknum >= s->data_start && blocknum < s->super.nblocks;
+}
+
+static void fsck_problem( struct fsck_state *s )
+{
+	__sync_fetch_and_add(&s->problems, 1);
+}
+
+static int fsck_claim( struct fsck_state *s, int blocknum, int inumber )
+/*
+Counts one more reference to blocknum and records the lowest inumber that refers to it,
+which is the inode that keeps the block if it turns out to be doubly allocated.  Returns
+the number of references counted before this one.
+*/
+{
+	int before = __sync_fetch_and_add(&s->refcount[blocknum], 1);
+	if (before == 1){
+		__sync_fetch_and_add(&s->duplicates, 1);
+	}
+	int current = s->owner[blocknum];
+	while (current == 0 || inumber < current){
+		int seen = __sync_val_compare_and_swap(&s->owner[blocknum], current, inumber);
+		if (seen == current) break;
+		current = seen;
+	}
+	return before;
+}
+
+static int fsck_check_inode( struct fsck_state *s, int inumber, struct fs_inode *inode )
+/*
+First pass over one valid inode: drops pointers that fall outside the data region, checks
+the size against the blocks actually allocated, and counts a reference for every block the
+inode keeps.  Returns one if the inode or its indirect block was modified.
+*/
+{
+	union fs_block indirect_block;
+	int ptrs[FSCK_MAX_POINTERS];
+	int i, nptrs, indirect_dirty = 0, inode_dirty = 0;
+	int max_size = FSCK_MAX_POINTERS * DISK_BLOCK_SIZE;
+	int compressed = inode->isvalid & INODE_COMPRESSED;
+
+	if (inode->size < 0 || inode->size > max_size){
+		printf("fsck: inode %d: size %d is out of range\n", inumber, inode->size);
+		fsck_problem(s);
+		if (s->repair){
+			inode->size = inode->size < 0 ? 0 : max_size;
+			inode_dirty = 1;
+		}
+	}
+
+	// Gather the logical block map, dropping pointers outside the data region
+	for (i = 0; i < POINTERS_PER_INODE; i++){
+		ptrs[i] = inode->direct[i];
+		if (ptrs[i] != 0 && !fsck_in_range(s, ptrs[i]) && !(compressed && ptrs[i] == BLOCK_COMPRESSED)){
+			printf("fsck: inode %d: direct pointer %d (%d) is out of range\n", inumber, i, ptrs[i]);
+			fsck_problem(s);
+			ptrs[i] = 0;
+		}
+	}
+	nptrs = POINTERS_PER_INODE;
+
+	if (inode->indirect != 0 && !fsck_in_range(s, inode->indirect)){
+		printf("fsck: inode %d: indirect block %d is out of range\n", inumber, inode->indirect);
+		fsck_problem(s);
+		if (s->repair){
+			inode->indirect = 0;
+			inode_dirty = 1;
+		}
+	}
+	if (fsck_in_range(s, inode->indirect)){
+		disk_read(inode->indirect, indirect_block.data);
+		if (!block_verify(inode->indirect, indirect_block.data)){
+			printf("fsck: inode %d: indirect block %d fails its checksum\n", inumber, inode->indirect);
+			fsck_problem(s);
+			if (s->repair) indirect_dirty = 1;
+		}
+		for (i = 0; i < POINTERS_PER_BLOCK; i++){
+			ptrs[nptrs + i] = indirect_block.pointers[i];
+			if (ptrs[nptrs + i] != 0 && !fsck_in_range(s, ptrs[nptrs + i]) && !(compressed && ptrs[nptrs + i] == BLOCK_COMPRESSED)){
+				printf("fsck: inode %d: indirect pointer %d (%d) is out of range\n", inumber, i, ptrs[nptrs + i]);
+				fsck_problem(s);
+				ptrs[nptrs + i] = 0;
+			}
+		}
+		nptrs += POINTERS_PER_BLOCK;
+	}
+
+	// The file is the run of allocated blocks from the start; size must fit inside it.  In a
+	// compressed file the slots a cluster saved are marked rather than allocated.
+	int allocated = 0;
+	while (allocated < nptrs && ptrs[allocated] != 0) allocated++;
+
+	int size = inode->size;
+	if (size > allocated * DISK_BLOCK_SIZE){
+		printf("fsck: inode %d: size %d exceeds the %d blocks allocated\n", inumber, size, allocated);
+		fsck_problem(s);
+		size = allocated * DISK_BLOCK_SIZE;
+		if (s->repair){
+			inode->size = size;
+			inode_dirty = 1;
+		}
+	}
+	int needed = (size + DISK_BLOCK_SIZE - 1) / DISK_BLOCK_SIZE;
+	for (i = needed; i < nptrs; i++){
+		if (ptrs[i] != 0){
+			printf("fsck: inode %d: block %d is allocated past the end of the file\n", inumber, ptrs[i]);
+			fsck_problem(s);
+			if (s->repair) ptrs[i] = 0;
+		}
+	}
+
+	// Write the cleaned block map back into the inode and indirect block
+	for (i = 0; i < POINTERS_PER_INODE; i++){
+		if (s->repair && inode->direct[i] != ptrs[i]){
+			inode->direct[i] = ptrs[i];
+			inode_dirty = 1;
+		}
+		if (fsck_in_range(s, inode->direct[i])) fsck_claim(s, inode->direct[i], inumber);
+	}
+	if (fsck_in_range(s, inode->indirect)){
+		// With reference counts, an indirect block shared by clones holds one reference to
+		// each block behind it, however many inodes share it
+		int used = 0, counted = 0;
+		if (REFCOUNTS.entries){
+			counted = fsck_claim(s, inode->indirect, inumber) > 0;
+		}
+		for (i = 0; i < POINTERS_PER_BLOCK; i++){
+			int p = indirect_block.pointers[i];
+			if (s->repair && p != ptrs[POINTERS_PER_INODE + i]){
+				indirect_block.pointers[i] = p = ptrs[POINTERS_PER_INODE + i];
+				indirect_dirty = 1;
+			}
+			if (fsck_in_range(s, p)){
+				if (!counted) fsck_claim(s, p, inumber);
+				used = 1;
+			}
+			else if (p == BLOCK_COMPRESSED){
+				used = 1;
+			}
+		}
+		if (s->repair && !used){
+			// Nothing left behind the indirect block, so release it too
+			if (REFCOUNTS.entries) __sync_fetch_and_sub(&s->refcount[inode->indirect], 1);
+			inode->indirect = 0;
+			inode_dirty = 1;
+			indirect_dirty = 0;
+		}
+		else if (!REFCOUNTS.entries){
+			fsck_claim(s, inode->indirect, inumber);
+		}
+		if (indirect_dirty) block_write(inode->indirect, indirect_block.data);
+	}
+
+	return inode_dirty;
+}
+
+static int fsck_check_shared( struct fsck_state *s, int inumber, struct fs_inode *inode )
+/*
+Second pass over one valid inode, run only when doubly-allocated blocks were found.  Every
+shared block is kept by its lowest-numbered owner; any other inode referring to it is
+reported and, when repairing, truncated just before the first block it does not own.
+Returns one if the inode was modified.
+*/
+{
+	union fs_block indirect_block;
+	int i, cut = -1;
+	int has_indirect = fsck_in_range(s, inode->indirect);
+
+	for (i = 0; i < POINTERS_PER_INODE; i++){
+		int p = inode->direct[i];
+		if (fsck_in_range(s, p) && s->refcount[p] > 1 && s->owner[p] != inumber){
+			printf("fsck: inode %d: block %d is also allocated to inode %d\n", inumber, p, s->owner[p]);
+			fsck_problem(s);
+			if (cut < 0) cut = i;
+		}
+	}
+	if (has_indirect){
+		int p = inode->indirect;
+		if (s->refcount[p] > 1 && s->owner[p] != inumber){
+			printf("fsck: inode %d: indirect block %d is also allocated to inode %d\n", inumber, p, s->owner[p]);
+			fsck_problem(s);
+			if (cut < 0) cut = POINTERS_PER_INODE;
+		}
+		disk_read(inode->indirect, indirect_block.data);
+		for (i = 0; i < POINTERS_PER_BLOCK; i++){
+			p = indirect_block.pointers[i];
+			if (fsck_in_range(s, p) && s->refcount[p] > 1 && s->owner[p] != inumber){
+				printf("fsck: inode %d: block %d is also allocated to inode %d\n", inumber, p, s->owner[p]);
+				fsck_problem(s);
+				if (cut < 0) cut = POINTERS_PER_INODE + i;
+			}
+		}
+	}
+
+	if (!s->repair || cut < 0) return 0;
+
+	// Drop this inode's reference to everything from the cut onwards
+	for (i = cut; i < POINTERS_PER_INODE; i++){
+		if (fsck_in_range(s, inode->direct[i])){
+			__sync_fetch_and_sub(&s->refcount[inode->direct[i]], 1);
+			inode->direct[i] = 0;
+		}
+	}
+	if (has_indirect){
+		int keep = cut - POINTERS_PER_INODE;
+		int shared = s->owner[inode->indirect] != inumber;
+		int dirty = 0;
+		for (i = (keep > 0 ? keep : 0); i < POINTERS_PER_BLOCK; i++){
+			int p = indirect_block.pointers[i];
+			if (fsck_in_range(s, p)){
+				__sync_fetch_and_sub(&s->refcount[p], 1);
+				if (!shared){
+					indirect_block.pointers[i] = 0;
+					dirty = 1;
+				}
+			}
+		}
+		if (keep <= 0){
+			__sync_fetch_and_sub(&s->refcount[inode->indirect], 1);
+			inode->indirect = 0;
+		}
+		else if (dirty){
+			block_write(inode->indirect, indirect_block.data);
+		}
+	}
+	if (inode->size > cut * DISK_BLOCK_SIZE){
+		inode->size = cut * DISK_BLOCK_SIZE;
+	}
+	return 1;
+}
+
+static void *fsck_worker( void *arg )
+{
+	struct fsck_state *s = arg;
+	union fs_block block;
+	int i, j;
+
+	while ((j = __sync_fetch_and_add(&s->next_inode_block, 1)) <= s->super.ninodeblocks){
+		int dirty = 0;
+		disk_read(j, block.data);
+		for (i = 0; i < INODES_PER_BLOCK; i++){
+			int inumber = (j-1)*INODES_PER_BLOCK + i;
+			struct fs_inode *inode = &block.inode[i];
+
+			if (s->pass == 1 && inode->isvalid != 0 && !inode_in_use(inode)){
+				printf("fsck: inode %d: corrupt valid flag %d\n", inumber, inode->isvalid);
+				fsck_problem(s);
+				if (s->repair){
+					memset(inode, 0, sizeof(*inode));
+					dirty = 1;
+				}
+			}
+			if (!inode_in_use(inode)) continue;
+
+			if (s->pass == 1){
+				s->valid[inumber] = (inode->isvalid & INODE_DIRECTORY) ? DIRECTORY_INODE : 1;
+				dirty |= fsck_check_inode(s, inumber, inode);
+			}
+			else{
+				dirty |= fsck_check_shared(s, inumber, inode);
+			}
+		}
+		if (dirty) disk_write(j, block.data);
+	}
+	return 0;
+}
+
+static void fsck_run_pass( struct fsck_state *s, int pass )
+{
+	pthread_t threads[FSCK_MAX_THREADS];
+	int i, nthreads;
+
+	nthreads = sysconf(_SC_NPROCESSORS_ONLN);
+	if (nthreads < 1) nthreads = 1;
+	if (nthreads > FSCK_MAX_THREADS) nthreads = FSCK_MAX_THREADS;
+	if (nthreads > s->super.ninodeblocks) nthreads = s->super.ninodeblocks;
+
+	s->pass = pass;
+	s->next_inode_block = 1;
+	for (i = 0; i < nthreads; i++){
+		if (pthread_create(&threads[i], 0, fsck_worker, s) != 0) break;
+	}
+	if (i == 0){
+		// Could not start any threads, so check the whole table from here
+		fsck_worker(s);
+	}
+	nthreads = i;
+	for (i = 0; i < nthreads; i++){
+		pthread_join(threads[i], 0);
+	}
+}
+
+static int fsck_dir_read( struct fsck_state *s, struct fs_inode *inode, char *data, int length )
+/*
+Reads the first length bytes of one of the directory's inodes straight from its block map,
+which works whether or not the disk is mounted.  Returns zero if the map leads outside the
+data region or a block fails its checksum.
+*/
+{
+	union fs_block indirect, block;
+	int i, nblocks = (length + DISK_BLOCK_SIZE - 1) / DISK_BLOCK_SIZE;
+
+	if (nblocks > POINTERS_PER_INODE && (!fsck_in_range(s, inode->indirect) || !block_read(inode->indirect, indirect.data))){
+		return 0;
+	}
+	for (i = 0; i < nblocks; i++){
+		int p = i < POINTERS_PER_INODE ? inode->direct[i] : indirect.pointers[i - POINTERS_PER_INODE];
+		int n = length - i * DISK_BLOCK_SIZE < DISK_BLOCK_SIZE ? length - i * DISK_BLOCK_SIZE : DISK_BLOCK_SIZE;
+		if (!fsck_in_range(s, p) || !block_read(p, block.data)) return 0;
+		memcpy(data + i * DISK_BLOCK_SIZE, block.data, n);
+	}
+	return 1;
+}
+
+static void fsck_dir_release( struct fsck_state *s, int inumber )
+/*
+Turns one of the directory's inodes into an ordinary file, so its blocks stay accounted for
+and it can be deleted like any other.
+*/
+{
+	struct fs_inode inode;
+	inode_load(inumber, &inode);
+	inode.isvalid = INODE_VALID;
+	inode_save(inumber, &inode);
+	s->valid[inumber] = 1;
+}
+
+static void fsck_dir_detach( struct fsck_state *s )
+/*
+Repairs a root directory that cannot be trusted by dropping it.  The superblock forgets it
+and every directory inode becomes an ordinary file.  The next link starts a new directory.
+*/
+{
+	union fs_block block;
+	int i;
+
+	disk_read(0, block.data);
+	block.super.root = 0;
+	disk_write(0, block.data);
+	s->super.root = 0;
+	for (i = 1; i < s->super.ninodes; i++){
+		if (s->valid[i] == DIRECTORY_INODE) fsck_dir_release(s, i);
+	}
+	if (IS_MOUNTED == 1){
+		SUPERBLOCK.root = 0;
+		free(DIR_TABLE);
+		DIR_TABLE = 0;
+		DIR_DEPTH = 0;
+	}
+}
+
+static int fsck_check_bucket( struct fsck_state *s, int bucket, int index, int depth, int *table, char *checked )
+/*
+Checks the bucket that table entry index leads to, the lowest entry to do so.  Its depth
+must fit the table and every entry sharing its low bits must lead to it.  Each name must be
+terminated and hash to the bucket, and the count must match.  Names that fail are dropped
+and the count corrected on repair, unless the bucket's block is shared with another file.
+Returns zero if the bucket cannot be trusted at all.
+*/
+{
+	struct fs_inode inode;
+	union fs_block block;
+	struct dir_bucket *b = &block.bucket;
+	int j, count = 0, dirty = 0, n = 1 << depth;
+
+	inode_load(bucket, &inode);
+	if (inode.size != DISK_BLOCK_SIZE || !fsck_dir_read(s, &inode, block.data, DISK_BLOCK_SIZE)){
+		printf("fsck: directory bucket inode %d cannot be read\n", bucket);
+		return 0;
+	}
+	if (b->depth < 0 || b->depth > depth || (index >> b->depth) != 0){
+		printf("fsck: directory bucket inode %d has an invalid depth %d\n", bucket, b->depth);
+		return 0;
+	}
+	for (j = index; j < n; j += 1 << b->depth){
+		if (table[j] != bucket){
+			printf("fsck: root directory entry %d should lead to bucket inode %d\n", j, bucket);
+			return 0;
+		}
+		checked[j] = 1;
+	}
+
+	for (j = 0; j < DIR_BUCKET_SLOTS; j++){
+		struct dir_entry *e = &b->entry[j];
+		if (e->inumber == 0) continue;
+		if (!memchr(e->name, 0, DIR_NAME_MAX + 1) || e->name[0] == 0 ||
+		    (int)(dir_hash(e->name) & ((1u << b->depth) - 1)) != index){
+			printf("fsck: directory bucket inode %d has a damaged name in slot %d\n", bucket, j);
+			fsck_problem(s);
+			memset(e, 0, sizeof(*e));
+			dirty = 1;
+			continue;
+		}
+		count++;
+	}
+	if (b->count != count){
+		printf("fsck: directory bucket inode %d says it holds %d names but holds %d\n", bucket, b->count, count);
+		fsck_problem(s);
+		b->count = count;
+		dirty = 1;
+	}
+	if (dirty && s->repair){
+		if (s->refcount[inode.direct[0]] > 1) return 0;
+		block_write(inode.direct[0], block.data);
+	}
+	return 1;
+}
+
+static void fsck_check_directory( struct fsck_state *s )
+/*
+Checks the root directory after the inodes themselves have been checked: the root must be
+a directory inode holding a table of a power of two entries, and every entry must lead to a
+sound bucket.  A directory that cannot be trusted is detached on repair.  Directory inodes
+that the directory does not reach are turned into ordinary files.
+*/
+{
+	struct fs_inode inode;
+	int *table = 0;
+	char *checked = 0;
+	char *seen = calloc(s->super.ninodes, 1);
+	int root = s->super.root;
+	int depth = 0, damaged = 0, i;
+
+	if (!seen){
+		printf("fsck: out of memory\n");
+		return;
+	}
+
+	if (root != 0){
+		if (root < 0 || root >= s->super.ninodes || s->valid[root] != DIRECTORY_INODE){
+			printf("fsck: root directory inode %d is not a directory inode\n", root);
+			damaged = 1;
+		}
+		else{
+			inode_load(root, &inode);
+			while (depth <= DIR_MAX_DEPTH && inode.size != (int)sizeof(int) << depth) depth++;
+			if (depth > DIR_MAX_DEPTH){
+				printf("fsck: root directory table has an invalid size of %d bytes\n", inode.size);
+				damaged = 1;
+			}
+			else{
+				table = malloc(inode.size);
+				checked = calloc(1 << depth, 1);
+				if (!table || !checked || !fsck_dir_read(s, &inode, (char *)table, inode.size)){
+					printf("fsck: root directory table cannot be read\n");
+					damaged = 1;
+				}
+				seen[root] = 1;
+			}
+		}
+	}
+
+	for (i = 0; root != 0 && !damaged && i < 1 << depth; i++){
+		int bucket = table[i];
+		if (bucket <= 0 || bucket >= s->super.ninodes || bucket == root || s->valid[bucket] != DIRECTORY_INODE){
+			printf("fsck: root directory entry %d leads to inode %d, which is not a bucket\n", i, bucket);
+			damaged = 1;
+		}
+		else if (!seen[bucket]){
+			seen[bucket] = 1;
+			if (!fsck_check_bucket(s, bucket, i, depth, table, checked)) damaged = 1;
+		}
+		else if (!checked[i]){
+			printf("fsck: root directory entry %d leads to bucket inode %d out of turn\n", i, bucket);
+			damaged = 1;
+		}
+	}
+
+	if (damaged){
+		fsck_problem(s);
+		if (s->repair) fsck_dir_detach(s);
+	}
+	else{
+		for (i = 1; i < s->super.ninodes; i++){
+			if (s->valid[i] == DIRECTORY_INODE && !seen[i]){
+				printf("fsck: directory inode %d is not part of the root directory\n", i);
+				fsck_problem(s);
+				if (s->repair) fsck_dir_release(s, i);
+			}
+		}
+	}
+
+	free(table);
+	free(checked);
+	free(seen);
+}
+
+static int do_fsck( int repair )
+/*
+Checks the filesystem for consistency.  Inode blocks are scanned in parallel; every pointer
+is checked against the data region, every size against the blocks actually allocated, and
+a reference count is built for every block so that doubly-allocated blocks can be found.
+If the filesystem is mounted, the free block and inode bitmaps are compared against what
+the inodes describe.  With dedup, blocks may be shared, so the reference count table is
+checked against the references actually found instead.  When repair is set, each problem
+is fixed as it is found.  Returns
+the number of problems found, or -1 if there is no filesystem on the disk.
+*/
+{
+	struct fsck_state s;
+	union fs_block block;
+	int i;
+
+	disk_read(0, block.data);
+	if (block.super.magic != FS_MAGIC){
+		printf("fsck: magic number is invalid\n");
+		return -1;
+	}
+
+	memset(&s, 0, sizeof(s));
+	s.super = block.super;
+	s.repair = repair;
+
+	if (s.super.nblocks != disk_size()){
+		printf("fsck: superblock says %d blocks but the disk has %d\n", s.super.nblocks, disk_size());
+		fsck_problem(&s);
+		s.super.nblocks = disk_size();
+		if (repair){
+			block.super.nblocks = s.super.nblocks;
+			disk_write(0, block.data);
+		}
+	}
+	if (s.super.ninodeblocks < 1 || s.super.ninodeblocks >= s.super.nblocks){
+		printf("fsck: superblock has an invalid inode table size (%d blocks)\n", s.super.ninodeblocks);
+		return s.problems + 1;
+	}
+	if (s.super.ninodes != s.super.ninodeblocks * INODES_PER_BLOCK){
+		printf("fsck: superblock says %d inodes but the inode table holds %d\n", s.super.ninodes, s.super.ninodeblocks * INODES_PER_BLOCK);
+		fsck_problem(&s);
+		s.super.ninodes = s.super.ninodeblocks * INODES_PER_BLOCK;
+		if (repair){
+			block.super.ninodes = s.super.ninodes;
+			disk_write(0, block.data);
+		}
+	}
+
+	// Checksums are verified and kept up to date even when the disk is not mounted
+	int loaded = 0;
+	if (!CHECKSUMS && (s.super.features & FS_FEATURE_CHECKSUM)){
+		if (!checksum_load(&s.super)){
+			printf("fsck: checksum table is invalid, checking without it\n");
+			fsck_problem(&s);
+			s.super.features &= ~FS_FEATURE_CHECKSUM;
+		}
+		else{
+			loaded = 1;
+		}
+	}
+	int refcounts_loaded = 0;
+	if (!REFCOUNTS.entries && (s.super.features & FS_FEATURES_SHARED)){
+		if (!refcount_load(&s.super)){
+			printf("fsck: reference count tables are invalid, checking without them\n");
+			fsck_problem(&s);
+			s.super.features &= ~FS_FEATURES_SHARED;
+		}
+		else{
+			refcounts_loaded = 1;
+		}
+	}
+	s.data_start = super_data_start(&s.super);
+
+	s.refcount = calloc(s.super.nblocks, sizeof(int));
+	s.owner = calloc(s.super.nblocks, sizeof(int));
+	s.valid = calloc(s.super.ninodes, sizeof(char));
+	if (!s.refcount || !s.owner || !s.valid){
+		printf("fsck: out of memory\n");
+		free(s.refcount);
+		free(s.owner);
+		free(s.valid);
+		if (loaded) checksum_unload();
+		if (refcounts_loaded) refcount_unload();
+		return -1;
+	}
+
+	cluster_cache_drop(0);
+	fsck_run_pass(&s, 1);
+	if (REFCOUNTS.entries){
+		// Shared blocks are legitimate here, as long as the table counts every reference
+		for (i = s.data_start; i < s.super.nblocks; i++){
+			unsigned int extra = s.refcount[i] > 1 ? s.refcount[i] - 1 : 0;
+			if (REFCOUNTS.entries[i] != extra){
+				printf("fsck: block %d has %d references but its reference count says %u\n", i, s.refcount[i], REFCOUNTS.entries[i] + 1);
+				fsck_problem(&s);
+				if (repair) table_set(&REFCOUNTS, i, extra);
+			}
+			if (s.refcount[i] == 0 && HASHES.entries && HASHES.entries[i] != 0){
+				printf("fsck: free block %d is still in the dedup index\n", i);
+				fsck_problem(&s);
+				if (repair){
+					if (DEDUP_INDEX) dedup_forget(i);
+					else table_set(&HASHES, i, 0);
+				}
+			}
+		}
+	}
+	else if (s.duplicates > 0){
+		fsck_run_pass(&s, 2);
+	}
+	fsck_check_directory(&s);
+
+	// Cross-check the in-memory bitmaps built at mount time
+	if (IS_MOUNTED == 1){
+		for (i = 0; i < s.super.nblocks; i++){
+			int used = (i < s.data_start) || (s.refcount[i] > 0);
+			if (block_in_use(i) && !used){
+				printf("fsck: block %d is marked in use but nothing refers to it\n", i);
+				fsck_problem(&s);
+			}
+			else if (!block_in_use(i) && used){
+				printf("fsck: block %d is in use but marked free\n", i);
+				fsck_problem(&s);
+			}
+			if (repair){
+				if (used) block_mark_used(i);
+				else block_mark_free(i);
+			}
+		}
+		for (i = 0; i < s.super.ninodes && i < SUPERBLOCK.ninodes; i++){
+			if (INODE_BITMAP[i] != s.valid[i]){
+				printf("fsck: inode %d is marked %s in the inode bitmap\n", i, INODE_BITMAP[i] ? "in use" : "free");
+				fsck_problem(&s);
+				if (repair){
+					if (s.valid[i]){
+						inode_mark_used(i);
+						INODE_BITMAP[i] = s.valid[i];
+					}
+					else inode_mark_free(i);
+				}
+			}
+		}
+	}
+
+	free(s.refcount);
+	free(s.owner);
+	free(s.valid);
+
+	if (loaded){
+		checksum_unload();
+	}
+	if (refcounts_loaded){
+		refcount_unload();
+	}
+	metadata_flush();
+
+	return s.problems;
+}
+
+int fs_fsck( int repair )
+{
+	pthread_rwlock_wrlock(&FS_LOCK);
+	int result = do_fsck(repair);
+	pthread_rwlock_unlock(&FS_LOCK);
+	return result;
+}
+
+
+//---------------------------------------------------Defragmenter---------------------------------------------------
+
+struct defrag_report {
+	int files;
+	int file_extents;
+	int free_blocks;
+	int free_extents;
+	int largest_free;
+};
+
+static int file_layout( struct fs_inode *inode, int *blocks, int *slots )
+/*
+Lists the physical blocks of a file in the order a sequential read touches them: the
+direct blocks, then the indirect block, then the blocks it points to.  If slots is given,
+it receives where each block is referenced from, numbered in the same order.  Returns the
+number of blocks listed, or -1 if the file has a pointer outside the data region or a block
+allocated past its end, either of which fsck reports.
+*/
+{
+	union fs_block indirect_block;
+	int nblocks = (inode->size + DISK_BLOCK_SIZE - 1) / DISK_BLOCK_SIZE;
+	int compressed = inode->isvalid & INODE_COMPRESSED;
+	int i, n = 0;
 
-			return i;
+	for (i = 0; i < POINTERS_PER_INODE; i++){
+		if (compressed && inode->direct[i] == BLOCK_COMPRESSED) continue;
+		if (i >= nblocks){
+			if (inode->direct[i] != 0) return -1;
+			continue;
 		}
+		if (!is_data_block(inode->direct[i])) return -1;
+		if (slots) slots[n] = i;
+		blocks[n++] = inode->direct[i];
 	}
-	
-	return 0;
+	if (nblocks <= POINTERS_PER_INODE && inode->indirect == 0) return n;
+	if (!is_data_block(inode->indirect)) return -1;
+	if (slots) slots[n] = POINTERS_PER_INODE;
+	blocks[n++] = inode->indirect;
+	disk_read(inode->indirect, indirect_block.data);
+	for (i = 0; i < POINTERS_PER_BLOCK; i++){
+		int p = indirect_block.pointers[i];
+		if (compressed && p == BLOCK_COMPRESSED) continue;
+		if (i >= nblocks - POINTERS_PER_INODE){
+			if (p != 0) return -1;
+			continue;
+		}
+		if (!is_data_block(p)) return -1;
+		if (slots) slots[n] = POINTERS_PER_INODE + 1 + i;
+		blocks[n++] = p;
+	}
+	return n;
+}
 
+static int count_extents( int *blocks, int n )
+{
+	int i, extents = n > 0;
+	for (i = 1; i < n; i++){
+		if (blocks[i] != blocks[i-1] + 1) extents++;
+	}
+	return extents;
 }
 
-int fs_delete( int inumber )
-/* Delete the inode indicated by the inumber. Release all data and indirect blocks assigned to this 
-inode and return them to the free block map. On success, return one. On failure, return 0.
+static void defrag_measure( struct defrag_report *r )
+/*
+Counts file extents and free-space extents across the whole mounted filesystem.
 */
 {
-	if (IS_MOUNTED == 0){
-		printf("disk not yet mounted \n");
-		return 0;
+	static int blocks[POINTERS_PER_INODE + 1 + POINTERS_PER_BLOCK];
+	struct fs_inode inode;
+	int i, run = 0;
+
+	memset(r, 0, sizeof(*r));
+	for (i = 1; i < SUPERBLOCK.ninodes; i++){
+		if (!INODE_BITMAP[i]) continue;
+		inode_load(i, &inode);
+		int n = file_layout(&inode, blocks, 0);
+		if (n <= 0) continue;
+		r->files++;
+		r->file_extents += count_extents(blocks, n);
 	}
-
-	// Convert the numbers
-	int block_number = inumber/127 + 1;
-	int i_number = inumber % 127;
-
-	
-	// Read the block
-	union fs_block block;
-	disk_read(block_number, block.data);
-	int i;
-
-
-	// Set everything to 0
-	if (block.inode[i_number].isvalid == 1){
-		// Set the isvalid to 0
-		block.inode[i_number].isvalid = 0;
-		INODE_BITMAP[i_number] = 0;
-		
-		// Set the size to 0
-		block.inode[i_number].size = 0; 
-
-		// Set the direct to 0
-		for (i = 0; i < POINTERS_PER_INODE; i++){
-			block.inode[i_number].direct[i] = 0;
-			BLOCK_BITMAP[block.inode[i_number].direct[i]] = 0;
+	for (i = first_data_block(); i <= SUPERBLOCK.nblocks; i++){
+		if (i < SUPERBLOCK.nblocks && !block_in_use(i)){
+			r->free_blocks++;
+			run++;
 		}
-
-		// Read the indirect block in
-		union fs_block indirect_block;
-		disk_read(block.inode[i_number].indirect , indirect_block.data);
-
-		// Set all the indirect pointers to 0
-		for (i = 0; i < POINTERS_PER_BLOCK; i++){
-			indirect_block.pointers[i] = 0;
-			BLOCK_BITMAP[indirect_block.pointers[i]] = 0;
+		else if (run > 0){
+			r->free_extents++;
+			if (run > r->largest_free) r->largest_free = run;
+			run = 0;
 		}
+	}
+}
 
-		// Set the indirect to 0
-		block.inode[i_number].indirect = 0;     
+static void defrag_print( const char *when, struct defrag_report *r )
+{
+	printf("%s: %d files in %d extents, %d free blocks in %d extents (largest %d)\n",
+		when, r->files, r->file_extents, r->free_blocks, r->free_extents, r->largest_free);
+}
 
-		// Write the block back to the disk
-		disk_write(block_number, block.data);
+// Blocks shared between files cannot be repointed with a single write, so they stay put
+#define DEFRAG_SHARED (-1)
 
-		return 1;
-		
+struct defrag_map {
+	int *owner;		// Inode owning each block, zero if free or metadata, DEFRAG_SHARED if shared
+	int *slot;		// Where each block is referenced from, as numbered by file_layout()
+};
+
+static int find_free_run( int length )
+/*
+Returns the first block of the lowest run of length free blocks, or zero if there is none.
+*/
+{
+	int i, run = 0;
+	for (i = first_data_block(); i < SUPERBLOCK.nblocks; i++){
+		run = block_in_use(i) ? 0 : run + 1;
+		if (run == length) return i - length + 1;
 	}
-	printf("%d is not a valid inode to delete \n", inumber);
 	return 0;
-	
 }
 
-int fs_getsize( int inumber )
+static int defrag_move( struct defrag_map *map, int from, int to )
 /*
-Return the logical size of the given inode, in bytes. Note that zero is a valid logical size 
-for an inode! On failure, return -1.
+Copies block from into the free block to and repoints its owner at the copy.  The single
+pointer write is the commit point: until it happens the old copy is still the live one, and
+the copy's checksum reaches the disk before it.  Nothing is moved, and zero is returned, if
+the block or the indirect block holding its pointer fails its checksum.
 */
 {
-	// Convert the numbers
-	int block_number = inumber/127 + 1;
-	int i_number = inumber % 127;
-	
-	// Read the block
-	union fs_block block;
-	disk_read(block_number, block.data);
-
-	if ( block.inode[i_number].isvalid == 1){
-		return block.inode[i_number].size;
+	union fs_block block, indirect_block;
+	struct fs_inode inode;
+	int inumber = map->owner[from];
+	int slot = map->slot[from];
+
+	inode_load(inumber, &inode);
+	if (!block_read(from, block.data)) return 0;
+	if (slot > POINTERS_PER_INODE && !block_read(inode.indirect, indirect_block.data)) return 0;
+
+	block_mark_used(to);
+	block_write(to, block.data);
+	checksum_flush();
+
+	if (slot < POINTERS_PER_INODE){
+		inode.direct[slot] = to;
+		inode_save(inumber, &inode);
+	}
+	else if (slot == POINTERS_PER_INODE){
+		inode.indirect = to;
+		inode_save(inumber, &inode);
 	}
 	else{
-		return -1;
+		// Rewritten in place, so the block and its checksum briefly disagree; fsck repair
+		// rewrites the checksum of an indirect block caught that way
+		indirect_block.pointers[slot - POINTERS_PER_INODE - 1] = to;
+		block_write(inode.indirect, indirect_block.data);
+		checksum_flush();
+	}
+
+	map->owner[to] = inumber;
+	map->slot[to] = slot;
+	map->owner[from] = 0;
+	block_mark_free(from);
+
+	if (HASHES.entries && HASHES.entries[from] != 0){
+		unsigned int hash = HASHES.entries[from];
+		dedup_forget(from);
+		dedup_insert(to, hash);
 	}
+	return 1;
 }
 
-int fs_read( int inumber, char *data, int length, int offset )
+static int defrag_spare( int start, int n, int target )
 /*
-Read data from a valid inode. Copy "length" bytes from the inode into the "data" pointer, 
-starting at "offset" in the inode. Return the total number of bytes read. The number of bytes 
-actually read could be smaller than the number of bytes requested, perhaps if the end of the 
-inode is reached. If the given inumber is invalid, or any other error is encountered, return 0.
+Picks a free block to evict into, preferring one past the window start..start+n-1, then one
+before it, then any free block inside it other than target.  Returns zero if the disk is full.
 */
 {
-
-	if (IS_MOUNTED == 0){
-		printf("file system has not yet been mounted. \n");
-		return 0;
-	}
-
-	// Convert the inumber 
-	int block_number = inumber/127 + 1;
-	int i_number = inumber % 127;
-	int begin_block = offset / DISK_BLOCK_SIZE;
-	int end_block = offset + length;
-
-
-	// Read the block
-	union fs_block block;
-	disk_read(block_number, block.data);
-
-	// Check if it's valid
-	if (INODE_BITMAP[inumber] == 0){
-		printf("error in reading.  invalid number.");
-		return 0;
+	int i;
+	for (i = start + n; i < SUPERBLOCK.nblocks; i++){
+		if (!block_in_use(i)) return i;
 	}
-
-	// If the length will put you off the block, set the 
-	// end block to the size 
-	if (length + offset > block.inode[i_number].size){
-		end_block = block.inode[i_number].size;
+	for (i = first_data_block(); i < start + n && i < SUPERBLOCK.nblocks; i++){
+		if (!block_in_use(i) && i != target) return i;
 	}
+	return 0;
+}
 
-	// Calculate the last block to read
-	int last_block = ceil((double)end_block / (double)DISK_BLOCK_SIZE);
-
-	// Get remainder
-	int partial_read = end_block % DISK_BLOCK_SIZE;
-
-	// Calculate the number of direct blocks
-	int num_direct_blocks;
+static int defrag_place( struct defrag_map *map, int inumber, int *blocks, int n, int start )
+/*
+Lays the file out in read order at blocks start..start+n-1.  A block already in the way is
+evicted to a free block outside the window when there is one.  Otherwise the file's own
+block is parked in the spare first, and the block in the way takes its place.  Either way a
+single free block is enough to make progress.  Returns the number of blocks moved, or -1 if
+the disk has no free block at all or a block fails its checksum.
+*/
+{
+	int i, moves = 0;
 
-	
-	if (last_block > POINTERS_PER_INODE){
-		num_direct_blocks = POINTERS_PER_INODE;
-	}
-	else{
-		num_direct_blocks = last_block;
-	}
+	for (i = 0; i < n; i++){
+		int target = start + i;
+		if (blocks[i] == target) continue;
 
-	// Read from begin_block --> last_block
-	// Loop through each of the blocks that the inode has
-	int i, index;
-	int data_read_so_far = 0;
-	union fs_block each_block;
-	for (i = begin_block; i < num_direct_blocks; i++){
-		if (i == last_block){
-			index = partial_read;
+		if (block_in_use(target) && map->owner[target] == 0){
+			// Marked in use but referenced by no file, so it is free to take
+			block_mark_free(target);
 		}
-		else{
-			index = DISK_BLOCK_SIZE;
+		if (block_in_use(target)){
+			int spare = defrag_spare(start, n, target);
+			if (spare == 0){
+				printf("no free block left to work with \n");
+				return -1;
+			}
+
+			int home = spare;
+			if (spare >= start && spare < start + n){
+				// No room outside the window, so free up this file's current block instead
+				if (!defrag_move(map, blocks[i], spare)) return -1;
+				home = blocks[i];
+				blocks[i] = spare;
+				moves++;
+			}
+			if (map->owner[target] == inumber){
+				int j;
+				for (j = i + 1; j < n && blocks[j] != target; j++);
+				if (j < n) blocks[j] = home;
+			}
+			if (!defrag_move(map, target, home)) return -1;
+			moves++;
 		}
-		
-		disk_read(block.inode[i_number].direct[i], each_block.data);
-		memcpy(data+data_read_so_far, each_block.data, index);
-		data_read_so_far = data_read_so_far + index;
-	}
 
-	int start_for_indirect;
-	if (begin_block >= 5){
-		start_for_indirect = begin_block;
-	}
-	else {
-		start_for_indirect = 0;
+		if (!defrag_move(map, blocks[i], target)) return -1;
+		blocks[i] = target;
+		moves++;
 	}
+	return moves;
+}
 
-	int num_indirect = last_block - num_direct_blocks;
+static int defrag_intact( const int *blocks, int n )
+/*
+Reads the n blocks of a file and returns one if every one matches its checksum.  Always
+true on a filesystem without checksums.
+*/
+{
+	static union fs_block data[VECTOR_BLOCKS];
+	char *buffers[VECTOR_BLOCKS];
+	int i, done;
+
+	if (!CHECKSUMS) return 1;
+	for (i = 0; i < VECTOR_BLOCKS; i++) buffers[i] = data[i].data;
+	for (done = 0; done < n; done += VECTOR_BLOCKS){
+		int batch = n - done < VECTOR_BLOCKS ? n - done : VECTOR_BLOCKS;
+		if (blocks_read(blocks + done, buffers, batch) < batch) return 0;
+	}
+	return 1;
+}
 
-	// Read the indirect block in
-	union fs_block indirect_block;
-	disk_read(block.inode[i_number].indirect , indirect_block.data);
+static int defrag_build_map( struct defrag_map *map )
+/*
+Records the owner of every block, marking blocks referenced more than once as shared.  A
+file whose block map cannot be followed in full would leave some of its blocks looking
+free, and moving other files over them would destroy it, so any such file stops the
+defragmenter before anything moves.  A file with a block that fails its checksum is left
+where it is, with all its blocks marked shared, since copying it would give the damaged
+data a fresh checksum.  Returns zero on failure.
+*/
+{
+	static int blocks[POINTERS_PER_INODE + 1 + POINTERS_PER_BLOCK];
+	static int slots[POINTERS_PER_INODE + 1 + POINTERS_PER_BLOCK];
+	struct fs_inode inode;
+	int i, j;
 
-	// Set all the indirect pointers to 0
-	int pointer;
-	union fs_block pointer_block;
-	for (i = start_for_indirect; i < num_indirect; i++){
-		if (i == last_block){
-			index = partial_read;
+	map->owner = calloc(SUPERBLOCK.nblocks, sizeof(int));
+	map->slot = calloc(SUPERBLOCK.nblocks, sizeof(int));
+	if (!map->owner || !map->slot) return 0;
+
+	for (i = 1; i < SUPERBLOCK.ninodes; i++){
+		if (!INODE_BITMAP[i]) continue;
+		inode_load(i, &inode);
+		int n = file_layout(&inode, blocks, slots);
+		if (n < 0){
+			printf("inode %d has invalid block pointers, run fsck first \n", i);
+			return 0;
 		}
-		else{
-			index = DISK_BLOCK_SIZE;
+		int intact = defrag_intact(blocks, n);
+		if (!intact) printf("inode %d has a damaged block and is left in place \n", i);
+		for (j = 0; j < n; j++){
+			if (!intact || map->owner[blocks[j]] != 0 || block_shared(blocks[j])){
+				map->owner[blocks[j]] = DEFRAG_SHARED;
+				continue;
+			}
+			map->owner[blocks[j]] = i;
+			map->slot[blocks[j]] = slots[j];
 		}
-		// Get the info for the block that the pointer is indicating
-		pointer = indirect_block.pointers[i];
-		disk_read(pointer, pointer_block.data);
-
-		// Copy over the data
-		memcpy(data+data_read_so_far, pointer_block.data, index);
-		data_read_so_far = data_read_so_far + index;
 	}
-	return data_read_so_far;
+	return 1;
 }
 
-int get_free_block(){
-	// Get the super block
-	union fs_block block;
-	disk_read(0,block.data);
-	struct fs_superblock super = block.super;
-	int num_blocks = super.nblocks;
-
+static int defrag_last_shared( struct defrag_map *map, int start, int n )
+/*
+Returns the last shared block among blocks start..start+n-1, or zero if there is none.
+*/
+{
 	int i;
-	for (i = 1; i < num_blocks; i++){
-		if (BLOCK_BITMAP[i] == 0 && i != 0){
-			return i;    
-		}
+	for (i = start + n - 1; i >= start; i--){
+		if (map->owner[i] == DEFRAG_SHARED) return i;
 	}
 	return 0;
 }
 
-int fs_write( int inumber, const char *data, int length, int offset )
+static int defrag_file( struct defrag_map *map, int inumber, int *cursor )
 /*
-Write data to a valid inode. Copy "length" bytes from the pointer "data" into the inode 
-starting at "offset" bytes. Allocate any necessary direct and indirect blocks in the process. 
-Return the number of bytes actually written. The number of bytes actually written could be 
-smaller than the number of bytes request, perhaps if the disk becomes full. If the given 
-inumber is invalid, or any other error is encountered, return 0.
+Makes one file contiguous.  With a cursor, the file is packed at the first run from the
+cursor with no shared block in it, and the cursor is advanced past it; otherwise the file
+goes to the lowest free run that holds it.  A file with shared blocks is left where it is.
+Returns the number of blocks moved, or -1 on failure.
 */
 {
-
-	//fs_debug();
-
-	// Check if it's been mounted
-	if (IS_MOUNTED == 0){
-		printf("file system has not yet been mounted. \n");
-		return 0;
+	static int blocks[POINTERS_PER_INODE + 1 + POINTERS_PER_BLOCK];
+	struct fs_inode inode;
+	int i, n, start, shared;
+
+	inode_load(inumber, &inode);
+	n = file_layout(&inode, blocks, 0);
+	if (n < 0){
+		printf("inode %d has invalid block pointers, run fsck first \n", inumber);
+		return -1;
 	}
-
-	// Check if it's a valid inode
-	if (INODE_BITMAP[inumber] == 0){
-		printf("error in writing.  invalid number. \n");
-		return 0;
+	if (n == 0) return 0;
+	for (i = 0; i < n; i++){
+		if (map->owner[blocks[i]] == DEFRAG_SHARED) return 0;
 	}
 
-
-
-	// Load the inode into the block
-	union fs_block block;
-	int block_number = inumber/127 + 1;
-	int i_number = inumber % 127;
-	disk_read(block_number, block.data);
-	struct fs_inode my_inode = block.inode[inumber];
-
-	// Get the size of the inode
-	int size_of_inode = my_inode.size;
-	int size_of_last_block = size_of_inode % DISK_BLOCK_SIZE;
-	int remainder_of_last_block = DISK_BLOCK_SIZE - size_of_last_block;
-	int last_block_is_full = 1;						// Assume the last block is full
-	if (remainder_of_last_block != 0){					// If the remainder calculated isn't 0
-		last_block_is_full = 0;						// The last block isn't full
+	if (cursor){
+		while (*cursor + n <= SUPERBLOCK.nblocks && (shared = defrag_last_shared(map, *cursor, n)) != 0){
+			*cursor = shared + 1;
+		}
+		if (*cursor + n > SUPERBLOCK.nblocks) return 0;
+		start = *cursor;
+		*cursor += n;
 	}
+	else{
+		if (count_extents(blocks, n) == 1) return 0;
+		start = find_free_run(n);
+		if (start == 0){
+			printf("no free run of %d blocks for inode %d, run defrag on the whole disk \n", n, inumber);
+			return 0;
+		}
+	}
+	return defrag_place(map, inumber, blocks, n, start);
+}
 
-	// Get the last block that is full
-	int last_block = ceil((double)(offset + length) / (double)DISK_BLOCK_SIZE);
+static int compare_keys( const void *a, const void *b )
+{
+	long long x = *(const long long *)a;
+	long long y = *(const long long *)b;
+	return (x > y) - (x < y);
+}
 
-	
+static int do_defrag( int inumber )
+/*
+Defragments the mounted filesystem.  Given a positive inumber, makes just that file
+contiguous.  Given zero, visits every file in order of its first block and packs each one
+in read order right after the previous, which leaves all free space in one extent at the
+end of the disk.  Blocks shared between files cannot be repointed with one write and stay
+where they are, so with reflink or dedup in use the files around them are packed in the
+gaps and free space may end up in more than one extent.  A filesystem with invalid block
+pointers is refused until fsck has repaired it, and a file with a block that fails its
+checksum is left in place.  Blocks are moved one at a time and each move is committed by a
+single pointer write, made only once the copy's checksum is on disk, and the other tables
+are written back after every file, so the operation can be interrupted at any point and
+simply run again.  Reports fragmentation before and after, and returns the number of files
+moved or -1 on failure.
+*/
+{
+	struct defrag_report before, after;
+	struct fs_inode inode;
+	int i, moved = 0, result = 0;
 
-	// Constant for how much data has been written so far
-	int data_written = 0;
+	if (IS_MOUNTED == 0){
+		printf("disk not yet mounted \n");
+		return -1;
+	}
+	if (inumber != 0 && (!is_valid_inumber(inumber) || INODE_BITMAP[inumber] == 0)){
+		printf("%d is not a valid inode to defragment \n", inumber);
+		return -1;
+	}
 
-	//-------------------------------------------Loop through the direct blocks----------------------------------------
-	int i, direct_block_num, w_size, new_direct_block;
-	union fs_block d_block;
+	struct defrag_map map;
+	if (!defrag_build_map(&map)){
+		free(map.owner);
+		free(map.slot);
+		return -1;
+	}
 
-	for (i = 0; i < POINTERS_PER_INODE; i++){
-		direct_block_num = my_inode.direct[i];				// Get the direct block number that inode has
-		//printf("Processing direct block num %d \n", direct_block_num);
-		disk_read(direct_block_num, d_block.data);			// Read the direct block 
+	defrag_measure(&before);
+	defrag_print("before", &before);
 
-		if ((direct_block_num == last_block) && !(last_block_is_full)){ 	// If we're processing the last block and the last block isn't full
-			//----------------------------------------Last Block Isn't Full----------------------------------------
-			new_direct_block = direct_block_num;			// Set the place to write to the last direct block
-			w_size = remainder_of_last_block;			// Set the size to write the rest of that block
-			if (length < remainder_of_last_block){			// If the amount we have to write is less than the remainder
-				w_size = length;				// Set the size to write equal to the length
-			}
+	if (inumber != 0){
+		result = defrag_file(&map, inumber, 0);
+		moved = result > 0;
+		metadata_flush();
+	}
+	else{
+		// Order the files by where they start so the packing sweeps towards the front
+		int nfiles = 0;
+		long long *keys = malloc(sizeof(long long) * SUPERBLOCK.ninodes);
+		if (!keys){
+			free(map.owner);
+			free(map.slot);
+			return -1;
+		}
+		for (i = 1; i < SUPERBLOCK.ninodes; i++){
+			if (!INODE_BITMAP[i]) continue;
+			inode_load(i, &inode);
+			if (inode.size <= 0) continue;
+			keys[nfiles] = (long long)inode.direct[0] * SUPERBLOCK.ninodes + i;
+			nfiles++;
+		}
+		qsort(keys, nfiles, sizeof(long long), compare_keys);
 
-			//-----------------------------------------Write to the block---------------------------------------------
-			memcpy(d_block.data+remainder_of_last_block, data+data_written+offset, w_size);	
-			data_written = data_written + w_size;			// Update how much data has been written so far
-			disk_write(new_direct_block, d_block.data);		// Write the block back to disk
+		int cursor = first_data_block();
+		for (i = 0; i < nfiles && result >= 0; i++){
+			result = defrag_file(&map, keys[i] % SUPERBLOCK.ninodes, &cursor);
+			if (result > 0) moved++;
+			metadata_flush();
+		}
+		free(keys);
+	}
 
-			size_of_inode = size_of_inode + w_size;		// Update the size of the inode
-			block.inode[inumber].size = size_of_inode;		// Reassign it to the inode data
-			disk_write(block_number, block.data);			// Write that inode data back to disk
+	free(map.owner);
+	free(map.slot);
+	metadata_flush();
 
-			if (data_written == length){
-				return data_written;
-			}
+	defrag_measure(&after);
+	defrag_print("after", &after);
 
-		}
+	if (result < 0){
+		printf("defrag stopped early \n");
+		return -1;
+	}
+	return moved;
+}
 
-		if (direct_block_num == 0 && BLOCK_BITMAP[direct_block_num] == 0){
-			//-------------------------------------Allocate a new direct block------------------------------------
-			new_direct_block = get_free_block();			// Get a new block
-			//printf("writing to direct block: %d \n", new_direct_block);
-			block.inode[inumber].direct[i] = new_direct_block;	// Add that new direct block to the array
-			disk_write(block_number, block.data);			// Write it back to disk
+int fs_defrag( int inumber )
+{
+	pthread_rwlock_wrlock(&FS_LOCK);
+	int result = do_defrag(inumber);
+	pthread_rwlock_unlock(&FS_LOCK);
+	return result;
+}
 
-			if (new_direct_block == 0){				// There are no more free blocks
-				return data_written;				// Just return the amount of data written so far
-			}
-			BLOCK_BITMAP[new_direct_block] = 1;			// You're going to use that block, so set it equal to unavailable (1)
-			my_inode.direct[i] = new_direct_block;			// Update the inode's direct array with the new block
-			w_size = DISK_BLOCK_SIZE;				// Set the default for writing to be equal to the block size
-			if (length - data_written < DISK_BLOCK_SIZE){ 		// If the amount of data to write is smaller than the block size
-				w_size = length - data_written;			// Update the write size to that smaller amount of data
-			}
+//------------------------------------------------Layout Report----------------------------------------------------
 
-			//-----------------------------------------Write to the block---------------------------------------------
-			memcpy(d_block.data, data+data_written+offset, w_size);	// Copy the data over
-			data_written = data_written + w_size;				// Update how much data has been written so far
-			disk_write(new_direct_block, d_block.data);			// Write the block back to disk
+// Inode blocks read per call to the disk layer while building a report
+#define REPORT_BATCH      64
+#define REPORT_BUFFER     65536
+#define REPORT_HISTOGRAM  32
 
-			size_of_inode = size_of_inode + w_size;			// Update the size of the inode
-			block.inode[inumber].size = size_of_inode;			// Reassign it to the inode data
-			disk_write(block_number, block.data);				// Write that inode data back to disk
+// Report text is gathered here and handed to stdio a buffer at a time
+struct report_out {
+	FILE *file;
+	int length;
+	char buffer[REPORT_BUFFER];
+};
 
-			if (data_written == length){
-				return data_written;
-			}
-		}
+static void report_flush( struct report_out *r )
+{
+	fwrite(r->buffer, 1, r->length, r->file);
+	r->length = 0;
+}
 
+static void report_printf( struct report_out *r, const char *fmt, ... )
+{
+	va_list args;
+	int n;
+
+	if (r->length > REPORT_BUFFER - 256) report_flush(r);
+	va_start(args, fmt);
+	n = vsnprintf(r->buffer + r->length, REPORT_BUFFER - r->length, fmt, args);
+	va_end(args);
+	if (n >= REPORT_BUFFER - r->length){
+		// Longer than what was left, so flush and format it again into the empty buffer
+		report_flush(r);
+		va_start(args, fmt);
+		n = vsnprintf(r->buffer, REPORT_BUFFER, fmt, args);
+		va_end(args);
+		if (n >= REPORT_BUFFER) n = REPORT_BUFFER - 1;
 	}
-	//------------------------------------------Loop through the indirect blocks---------------------------------------
-
-	// Reinitialize the block
-	union fs_block og_block;
-	block_number = inumber/127 + 1;
-	disk_read(block_number, og_block.data);
-	my_inode = og_block.inode[inumber];
-
-	//printf("indirect from og: %d \n", my_inode.indirect);
+	r->length += n;
+}
 
-	int indirect_present = my_inode.indirect;
+static int pointers_in_use( const int *pointers, int n )
+/*
+Returns how many slots of a block map lead up to its last non-zero pointer.  Block maps are
+filled from the front, so the scan runs backwards over the empty tail four pointers at a time.
+*/
+{
+#ifdef __SSE2__
+	const __m128i zero = _mm_setzero_si128();
+	while (n >= 4){
+		__m128i v = _mm_loadu_si128((const __m128i *)(pointers + n - 4));
+		if (_mm_movemask_epi8(_mm_cmpeq_epi32(v, zero)) != 0xffff) break;
+		n -= 4;
+	}
+#endif
+	while (n > 0 && pointers[n-1] == 0) n--;
+	return n;
+}
 
-	size_of_inode = my_inode.size;
+struct report_file {
+	int blocks;		// Data and indirect blocks listed so far
+	int extents;
+	int last;		// Last block listed, to tell whether the next one extends its extent
+	int start;		// First block of the extent being built
+	int damaged;		// Pointers outside the data region, left out of the extents
+};
 
-	int j, new_indirect_block;
-	union fs_block indirect_block;
-	union fs_block pointer_block;
-	if (data_written < length){						// All the data has not been written yet
-
-		//---------------------------------------NO INDIRECT BLOCK PRESENT----------------------------------------------
-		if (!indirect_present){						// There is no indirect block present
-			int new_indirect_num = get_free_block();		// Get a new block number for that indirect block
-			if (new_indirect_num == 0){				// There are no more free blocks
-				return data_written;				// Return the amount of data written so far
-			}
-			//printf("Initializing indirect block %d \n", new_indirect_num);
-			BLOCK_BITMAP[new_indirect_num] = 1;			// Set it to unavailable
-			og_block.inode[i_number].indirect = new_indirect_num;	// Assign the indirect to that block
-
-			disk_write(block_number, og_block.data);			// Write it back
-
-			disk_read(new_indirect_num, indirect_block.data);	// Read that new indirect block
-
-			/*int u;
-			for (u = 0; u < POINTERS_PER_BLOCK; u++){
-				printf("u = %d and data is %d \n", u, indirect_block.pointers[u]);
-			}*/
-
-			while(data_written < length){
-				for (j = 0; j < POINTERS_PER_BLOCK; j++){
-					//------------------------------Allocate a new indirect pointer-----------------------------------
-					int new_i_block = get_free_block();					// Get a new block
-					if (new_i_block == 0){							// There are no more free blocks
-						return data_written;						// Return the amount of data written so far
-					}
-					BLOCK_BITMAP[new_i_block] = 1;					// Set the block to unavailable
-					indirect_block.pointers[j] = new_i_block;				// Update inode's indirect ptrs w/ new block	
-					
-					disk_write(new_indirect_num, indirect_block.data);			// Write the indirect block back to disk
-					
-
-					disk_read(new_i_block, pointer_block.data);				// Read that pointer block in
-					
-					//-----------------------------------Write to the block----------------------------------------
-					int w_size = DISK_BLOCK_SIZE;						// Set the default for writing to be 
-														// equal to the block size
-					if (length - data_written < DISK_BLOCK_SIZE){ 				// If the amount of data to write is smaller 
-														// than the block size
-						w_size = length - data_written;					// Update the write size
-					}
-					memcpy(pointer_block.data, data+data_written+offset, w_size);	// Copy the data over
-					data_written = data_written + w_size;					// Update how much data has been 
-														// written so far
-					disk_write(new_i_block, pointer_block.data);				// Write the pointer block back to disk
-
-					size_of_inode = size_of_inode + w_size;			// Update the size of the inode
-					og_block.inode[inumber].size = size_of_inode;			// Reassign it to the inode data
-					disk_write(block_number, og_block.data);			// Write that inode data back to disk
-
-					//printf("Writing to pointer block %d \n", new_i_block);
-					
-					if (data_written == length){
-						return data_written;
-					}
-				}
-			}
+static void report_block( struct report_out *r, struct report_file *f, int blocknum )
+/*
+Adds a block to the extent list of the file being reported, in read order.  An extent is
+written out as [start,length] once the block after it turns out not to follow on.
+*/
+{
+	if (!is_data_block(blocknum)){
+		f->damaged++;
+		return;
+	}
+	if (f->blocks > 0 && blocknum == f->last + 1){
+		f->last = blocknum;
+		f->blocks++;
+		return;
+	}
+	if (f->blocks > 0){
+		report_printf(r, "%s[%d,%d]", f->extents > 1 ? "," : "", f->start, f->last - f->start + 1);
+	}
+	f->start = f->last = blocknum;
+	f->blocks++;
+	f->extents++;
+}
 
+static void report_inode( struct report_out *r, int inumber, struct fs_inode *inode, const int *indirect, int *first )
+/*
+Writes the JSON object for one file: its size, block counts, extents in read order and how
+fragmented it is, from zero when it is contiguous to one when no two blocks are neighbours.
+indirect holds the pointers of its indirect block, or is null if it has none.
+*/
+{
+	struct report_file f;
+	int compressed = inode->isvalid & INODE_COMPRESSED;
+	int i, n, data = 0;
+
+	memset(&f, 0, sizeof(f));
+	report_printf(r, "%s\n{\"inumber\":%d,\"size\":%d,\"compressed\":%s,\"logical_blocks\":%d,\"indirect\":%d,\"extents\":[",
+		*first ? "" : ",", inumber, inode->size, compressed ? "true" : "false",
+		(inode->size + DISK_BLOCK_SIZE - 1) / DISK_BLOCK_SIZE, inode->indirect);
+	*first = 0;
+
+	n = pointers_in_use(inode->direct, POINTERS_PER_INODE);
+	for (i = 0; i < n; i++){
+		if (compressed && inode->direct[i] == BLOCK_COMPRESSED) continue;
+		report_block(r, &f, inode->direct[i]);
+		data++;
+	}
+	if (inode->indirect != 0){
+		report_block(r, &f, inode->indirect);
+	}
+	if (indirect){
+		n = pointers_in_use(indirect, POINTERS_PER_BLOCK);
+		for (i = 0; i < n; i++){
+			if (indirect[i] == 0 || (compressed && indirect[i] == BLOCK_COMPRESSED)) continue;
+			report_block(r, &f, indirect[i]);
+			data++;
 		}
-		//---------------------------------------INDIRECT BLOCK IS PRESENT----------------------------------------------
-		else{									
-			//printf("Indirect block is present and is: %d\n", indirect_present);
-			disk_read(indirect_present, indirect_block.data);
-
-			int last_indirect_ptr;
+	}
+	if (f.blocks > 0){
+		report_printf(r, "%s[%d,%d]", f.extents > 1 ? "," : "", f.start, f.last - f.start + 1);
+	}
+	report_printf(r, "],\"data_blocks\":%d,\"blocks\":%d,\"nextents\":%d,\"fragmentation\":%.4f,\"damaged_pointers\":%d}",
+		data - f.damaged, f.blocks, f.extents, f.blocks > 1 ? (double)(f.extents - 1) / (f.blocks - 1) : 0.0, f.damaged);
+}
 
-			/*int y;
-			for (y = 0; y < POINTERS_PER_BLOCK; y++){
-				printf("y = %d and data is %d \n", y, indirect_block.pointers[y]);
-			}*/
+static int do_report( FILE *file )
+/*
+Writes a JSON description of the mounted filesystem's layout to file: the geometry, one
+object per file, and a histogram of free-space extents by length, in powers of two.  Inode
+blocks are read REPORT_BATCH at a time and the indirect blocks of each batch's files
+VECTOR_BLOCKS at a time, so a report takes a few large reads rather than one per block.
+Returns one on success and zero on failure.
+*/
+{
+	long long hist_extents[REPORT_HISTOGRAM], hist_blocks[REPORT_HISTOGRAM];
+	int blocknums[REPORT_BATCH], indirect_nums[VECTOR_BLOCKS];
+	char *buffers[REPORT_BATCH], *indirect_buffers[VECTOR_BLOCKS];
+	int owners[VECTOR_BLOCKS];
+	int i, j, k, first = 1;
+	int files = 0, free_blocks = 0, free_extents = 0, largest = 0, run = 0;
 
-			union fs_block super;
-			disk_read(0, super.data);
-			int total_blocks = super.super.nblocks;
+	if (IS_MOUNTED == 0){
+		printf("disk not yet mounted \n");
+		return 0;
+	}
 
-			int o, index;
-			int num_of_indirect_blocks = 0;
-			for (o = 0; o < 1024; o++){
-				if (indirect_block.pointers[o] < total_blocks){
-					
-					num_of_indirect_blocks++;
-				}
-				else{
-					index = o - 1;
-					last_indirect_ptr = indirect_block.pointers[index];
-					break;
-				}
-			}
-			//printf("num of indirect blocks is: %d \n", num_of_indirect_blocks);
-			//printf("called debug before if statement for last block is full \n");
-			//fs_debug();
-			if (!last_block_is_full){						// The last indirect block is not completely full
-				disk_read(last_indirect_ptr, indirect_block.data);
-				//printf("Last blog isn't full \n");
-				//----------------------------Last Block Isn't Full---------------------------------------------
-				new_indirect_block = last_indirect_ptr;			// Set the place to write to the last direct block
-				w_size = remainder_of_last_block;			// Set the size to write the rest of that block
-				if (length < remainder_of_last_block){			// If the amount we have to write is less than the remainder
-					w_size = length;				// Set the size to write equal to the length
-				}
-				//printf("Size to write is %d \n", w_size);
-				//--------------------------------Write to the block------------------------------------------
-				memcpy(indirect_block.data, data+data_written+offset, w_size);	
-				data_written = data_written + w_size;			// Update how much data has been written so far
-				disk_write(last_indirect_ptr, indirect_block.data);	// Write back to disk
-
-				//printf("**AFTER WRITING TO THE LAST BLOW \n");
-				//printf("Writing to indirect block %d\n", new_indirect_block);
-				//fs_debug();
-
-				//printf("Size of the inode before update: %d \n", size_of_inode);
-				size_of_inode = size_of_inode + w_size;			// Update the size of the inode
-
-				og_block.inode[inumber].size = size_of_inode;			// Reassign it to the inode data
-				disk_write(block_number, og_block.data);			// Write that inode data back to disk
-				
-				
-				//fs_debug();
-				if (data_written == length){
-					return data_written;
-				}
+	struct report_out *r = malloc(sizeof(*r));
+	union fs_block *inodes = malloc(sizeof(union fs_block) * REPORT_BATCH);
+	union fs_block *indirects = malloc(sizeof(union fs_block) * VECTOR_BLOCKS);
+	if (!r || !inodes || !indirects){
+		printf("not enough memory for a report \n");
+		free(r);
+		free(inodes);
+		free(indirects);
+		return 0;
+	}
+	r->file = file;
+	r->length = 0;
+	for (i = 0; i < REPORT_BATCH; i++) buffers[i] = inodes[i].data;
+	for (i = 0; i < VECTOR_BLOCKS; i++) indirect_buffers[i] = indirects[i].data;
+
+	report_printf(r, "{\"nblocks\":%d,\"block_size\":%d,\"ninodeblocks\":%d,\"ninodes\":%d,\"data_start\":%d,\"features\":%d,\"files\":[",
+		SUPERBLOCK.nblocks, DISK_BLOCK_SIZE, SUPERBLOCK.ninodeblocks, SUPERBLOCK.ninodes, first_data_block(), SUPERBLOCK.features);
+
+	for (i = 1; i <= SUPERBLOCK.ninodeblocks; i += REPORT_BATCH){
+		int n = SUPERBLOCK.ninodeblocks - i + 1 < REPORT_BATCH ? SUPERBLOCK.ninodeblocks - i + 1 : REPORT_BATCH;
+		for (j = 0; j < n; j++) blocknums[j] = i + j;
+		disk_readv(blocknums, buffers, n);
+
+		// Walk the batch's inodes in order, reading ahead the indirect blocks of up to
+		// VECTOR_BLOCKS files at a time, then report each file once its block is in hand
+		int next = 0, total = n * INODES_PER_BLOCK;
+		while (next < total){
+			int nindirect = 0, end;
+			for (end = next; end < total; end++){
+				struct fs_inode *inode = &inodes[end / INODES_PER_BLOCK].inode[end % INODES_PER_BLOCK];
+				if (!inode_in_use(inode) || !is_data_block(inode->indirect)) continue;
+				if (nindirect == VECTOR_BLOCKS) break;
+				indirect_nums[nindirect] = inode->indirect;
+				owners[nindirect++] = end;
 			}
-			while(data_written < length){
-				for (j = num_of_indirect_blocks; j <= POINTERS_PER_BLOCK; j++){
-					//------------------------------Allocate a new indirect pointer-----------------------------------
-					int new_i_block = get_free_block();		// Get a new block
-					if (new_i_block == 0){
-						return data_written;
-					}
-					//printf("new pointer is: %d \n", new_i_block);
-					//printf("j position for the new pointer in the pointer array is %d \n", j);
-					BLOCK_BITMAP[new_i_block] = 1;		// You're going to use that block, so set it equal to unavailable (1)
-					indirect_block.pointers[j] = new_i_block;	// Update the inode's indirect ptrs with the new block	
-					//printf("before the write for new pointers \n");
-					//fs_debug();
-					//printf("indirect we're writing back to: %d \n", indirect_present);
-					union fs_block indirect_block_again;
-					disk_read(indirect_present, indirect_block_again.data);
-					indirect_block_again.pointers[j] = new_i_block;
-					disk_write(indirect_present, indirect_block_again.data);
-					//disk_write(indirect_present, indirect_block.data);			// Write the indirect block back to disk
-					//fs_debug();
-
-					//-----------------------------------Write to the block----------------------------------------
-					int w_size = DISK_BLOCK_SIZE;					// Set the default for writing to be equal to the block size
-					if (length - data_written < DISK_BLOCK_SIZE){ 			// If the amount of data to write is smaller than the block size
-						w_size = length - data_written;				// Update the write size to that smaller amount of data
-					}
-					memcpy(indirect_block.data, data+data_written+offset, w_size);	// Copy the data over
-					data_written = data_written + w_size;					// Update how much data has been written so far
-					disk_write(new_i_block, indirect_block.data);				// Write the block back to disk
-
-					//printf("Writing to indirect block %d\n", new_i_block);
-					//fs_debug();
-					size_of_inode = size_of_inode + w_size;			// Update the size of the inode
-
-					//printf("Size of the inode: %d \n", size_of_inode);
-					og_block.inode[inumber].size = size_of_inode;			// Reassign it to the inode data
-					disk_write(block_number, og_block.data);			// Write that inode data back to disk
-
-					
-					if (data_written == length){
-						return data_written;
-					}
+			int intact = blocks_read(indirect_nums, indirect_buffers, nindirect);
+
+			for (k = 0, j = next; j < end; j++){
+				int inumber = (i - 1) * INODES_PER_BLOCK + j;
+				struct fs_inode *inode = &inodes[j / INODES_PER_BLOCK].inode[j % INODES_PER_BLOCK];
+				const int *indirect = 0;
+				if (k < nindirect && owners[k] == j){
+					if (k < intact) indirect = indirects[k].pointers;
+					k++;
 				}
+				if (inumber == 0 || !inode_in_use(inode)) continue;
+				report_inode(r, inumber, inode, indirect, &first);
+				files++;
 			}
-
+			next = end;
 		}
 	}
-	return 0;
-}
 
+	// Free space, as runs of free data blocks bucketed by the power of two below their length
+	memset(hist_extents, 0, sizeof(hist_extents));
+	memset(hist_blocks, 0, sizeof(hist_blocks));
+	for (i = first_data_block(); i <= SUPERBLOCK.nblocks; i++){
+		if (i < SUPERBLOCK.nblocks && !block_in_use(i)){
+			run++;
+			continue;
+		}
+		if (run == 0) continue;
+		for (k = 0; (2 << k) <= run && k < REPORT_HISTOGRAM - 1; k++);
+		hist_extents[k]++;
+		hist_blocks[k] += run;
+		free_blocks += run;
+		free_extents++;
+		if (run > largest) largest = run;
+		run = 0;
+	}
 
+	report_printf(r, "\n],\"nfiles\":%d,\"free_blocks\":%d,\"free_extents\":%d,\"largest_free\":%d,\"free_histogram\":[",
+		files, free_blocks, free_extents, largest);
+	for (k = 0, first = 1; k < REPORT_HISTOGRAM; k++){
+		if (hist_extents[k] == 0) continue;
+		report_printf(r, "%s{\"min\":%d,\"max\":%d,\"extents\":%lld,\"blocks\":%lld}",
+			first ? "" : ",", 1 << k, (2 << k) - 1, hist_extents[k], hist_blocks[k]);
+		first = 0;
+	}
+	report_printf(r, "]}\n");
+	report_flush(r);
 
+	free(r);
+	free(inodes);
+	free(indirects);
+	return !ferror(file);
+}
 
+int fs_report( FILE *file )
+{
+	int caller = disk_trace_caller(TRACE_CALLER_OTHER);
+	pthread_rwlock_rdlock(&FS_LOCK);
+	int result = do_report(file);
+	pthread_rwlock_unlock(&FS_LOCK);
+	disk_trace_caller(caller);
+	return result;
+}
@@ -1,15 +1,37 @@
 #ifndef FS_H
 #define FS_H
 
+#include <stdio.h>
+#include <sys/uio.h>
+
+// Optional on-disk features, chosen at format time
+#define FS_FEATURE_CHECKSUM 0x1
+#define FS_FEATURE_DEDUP    0x2
+#define FS_FEATURE_REFLINK  0x4
+
 void fs_debug();
 int  fs_format();
+int  fs_format_features( int features );
 int  fs_mount();
+int  fs_fsck( int repair );
+int  fs_defrag( int inumber );
+int  fs_report( FILE *file );
 
 int  fs_create();
+int  fs_create_many( int n, int *inumbers );
 int  fs_delete( int inumber );
+int  fs_truncate( int inumber, int newsize );
+int  fs_clone( int inumber );
 int  fs_getsize();
+int  fs_compress( int inumber, int enable );
 
 int  fs_read( int inumber, char *data, int length, int offset );
 int  fs_write( int inumber, const char *data, int length, int offset );
+int  fs_readv( int inumber, const struct iovec *iov, int iovcnt, int offset );
+int  fs_writev( int inumber, const struct iovec *iov, int iovcnt, int offset );
+
+int  fs_lookup( const char *name );
+int  fs_link( const char *name, int inumber );
+int  fs_unlink( const char *name );
 
 #endif
\ No newline at end of file
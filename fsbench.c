@@ -0,0 +1,314 @@
+/*
+Throughput and latency benchmark for simplefs.  For each image size given on the command
+line, a fresh image is formatted (with checksums if -c is given) and populated, with the
+test file compressed if -z is given, then remounted in a new process so mount and delete
+are measured against a populated table.  With -q, the random reads are run a second time
+through the async pool, kept that many deep from a single thread.  With -s, each image is
+striped across that many files.  Results are written as one JSON object per image size,
+appended to the output file, so runs can be compared from one build to the next.
+*/
+
+#include "fs.h"
+#include "disk.h"
+#include "async.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/wait.h>
+
+#define BENCH_CHUNK      65536
+#define BENCH_MAX_FILES  1000
+#define BENCH_MAX_FILE   ((5 + 1024) * DISK_BLOCK_SIZE)
+#define BENCH_MAX_DEPTH  64
+#define BENCH_MAX_MEMBERS 16
+
+static int features = 0;
+static int compress = 0;
+static int depth = 0;
+static int members = 1;
+
+struct bench_result {
+	int ok;
+	int files;
+	long long file_bytes;
+	double format_ms;
+	double create_per_sec;
+	double seq_write_MBps;
+	double seq_read_MBps;
+	double rand_write_MBps;
+	double rand_read_MBps;
+	double async_read_MBps;
+	double mount_ms;
+	double delete_ms;
+	double delete_per_sec;
+};
+
+static double now_sec()
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC,&ts);
+	return ts.tv_sec + ts.tv_nsec/1e9;
+}
+
+static double mbps( long long bytes, double seconds )
+{
+	return seconds>0 ? bytes/seconds/1e6 : 0;
+}
+
+static int bench_populate( const char *path, int nblocks, struct bench_result *r )
+/*
+Formats a fresh image, creates the files, and measures sequential and random I/O on inode 1.
+*/
+{
+	static char buffer[BENCH_CHUNK];
+	double start;
+	long long offset;
+	int i, count;
+
+	unlink(path);
+	if(!disk_init(path,nblocks)) {
+		printf("couldn't initialize %s: %s\n",path,strerror(errno));
+		return 0;
+	}
+
+	start = now_sec();
+	if(!fs_format_features(features)) return 0;
+	r->format_ms = (now_sec()-start)*1e3;
+
+	if(!fs_mount()) return 0;
+
+	// Data blocks left after the superblock and inode table, half of them used for the test file
+	int ninodeblocks = nblocks*.10 + 1;
+	int ninodes = ninodeblocks*128;
+	long long data_blocks = nblocks - ninodeblocks - 1;
+	r->file_bytes = data_blocks/2*DISK_BLOCK_SIZE;
+	if(r->file_bytes>BENCH_MAX_FILE) r->file_bytes = BENCH_MAX_FILE;
+	if(r->file_bytes<DISK_BLOCK_SIZE) return 0;
+
+	r->files = ninodes-1 < BENCH_MAX_FILES ? ninodes-1 : BENCH_MAX_FILES;
+	start = now_sec();
+	for(i=0;i<r->files;i++) {
+		if(!fs_create()) break;
+	}
+	r->files = i;
+	r->create_per_sec = r->files/(now_sec()-start);
+	if(r->files<1) return 0;
+	if(compress && !fs_compress(1,1)) return 0;
+
+	// Text-like contents, so a compressed run has something realistic to work with
+	for(i=0;i<BENCH_CHUNK;i+=64) {
+		char line[65];
+		snprintf(line,sizeof(line),"%08d %-54.54s\n",i,"the quick brown fox jumps over the lazy dog, 0123456789");
+		memcpy(buffer+i,line,64);
+	}
+
+	start = now_sec();
+	for(offset=0;offset<r->file_bytes;) {
+		int length = r->file_bytes-offset < BENCH_CHUNK ? r->file_bytes-offset : BENCH_CHUNK;
+		int actual = fs_write(1,buffer,length,offset);
+		if(actual<=0) return 0;
+		offset += actual;
+	}
+	r->seq_write_MBps = mbps(offset,now_sec()-start);
+
+	start = now_sec();
+	for(offset=0;offset<r->file_bytes;) {
+		int actual = fs_read(1,buffer,BENCH_CHUNK,offset);
+		if(actual<=0) return 0;
+		offset += actual;
+	}
+	r->seq_read_MBps = mbps(offset,now_sec()-start);
+
+	// Random single-block I/O, one operation per block of the file, from a fixed seed
+	count = r->file_bytes/DISK_BLOCK_SIZE;
+
+	srand(1);
+	start = now_sec();
+	for(i=0;i<count;i++) {
+		offset = (long long)(rand()%count)*DISK_BLOCK_SIZE;
+		if(fs_read(1,buffer,DISK_BLOCK_SIZE,offset)!=DISK_BLOCK_SIZE) return 0;
+	}
+	r->rand_read_MBps = mbps((long long)count*DISK_BLOCK_SIZE,now_sec()-start);
+
+	// The same reads again, with depth of them kept in flight through the async pool
+	if(depth>0) {
+		static char slots[BENCH_MAX_DEPTH][DISK_BLOCK_SIZE];
+		struct fs_completion done[BENCH_MAX_DEPTH];
+		int submitted = 0, finished = 0;
+
+		if(!fs_async_start(depth)) return 0;
+		srand(1);
+		start = now_sec();
+		for(i=0;i<depth && submitted<count;i++,submitted++) {
+			offset = (long long)(rand()%count)*DISK_BLOCK_SIZE;
+			if(!fs_read_async(1,slots[i],DISK_BLOCK_SIZE,offset,0,(void *)(long)i)) return 0;
+		}
+		while(finished<count) {
+			int n = fs_async_wait(done,BENCH_MAX_DEPTH);
+			if(n==0) return 0;
+			for(i=0;i<n;i++) {
+				int slot = (long)done[i].tag;
+				if(done[i].result!=DISK_BLOCK_SIZE) return 0;
+				finished++;
+				if(submitted<count) {
+					offset = (long long)(rand()%count)*DISK_BLOCK_SIZE;
+					if(!fs_read_async(1,slots[slot],DISK_BLOCK_SIZE,offset,0,(void *)(long)slot)) return 0;
+					submitted++;
+				}
+			}
+		}
+		r->async_read_MBps = mbps((long long)count*DISK_BLOCK_SIZE,now_sec()-start);
+		fs_async_stop();
+	}
+
+	srand(2);
+	start = now_sec();
+	for(i=0;i<count;i++) {
+		offset = (long long)(rand()%count)*DISK_BLOCK_SIZE;
+		if(fs_write(1,buffer,DISK_BLOCK_SIZE,offset)!=DISK_BLOCK_SIZE) return 0;
+	}
+	r->rand_write_MBps = mbps((long long)count*DISK_BLOCK_SIZE,now_sec()-start);
+
+	disk_close();
+	return 1;
+}
+
+static int bench_remount( const char *path, int nblocks, struct bench_result *r )
+/*
+Mounts the populated image from scratch and deletes every file on it.
+*/
+{
+	double start;
+	int i;
+
+	if(!disk_init(path,nblocks)) {
+		printf("couldn't initialize %s: %s\n",path,strerror(errno));
+		return 0;
+	}
+
+	start = now_sec();
+	if(!fs_mount()) return 0;
+	r->mount_ms = (now_sec()-start)*1e3;
+
+	start = now_sec();
+	for(i=1;i<=r->files;i++) {
+		if(!fs_delete(i)) return 0;
+	}
+	r->delete_ms = (now_sec()-start)*1e3;
+	r->delete_per_sec = r->files/(now_sec()-start);
+
+	disk_close();
+	return 1;
+}
+
+static int run_child( int (*phase)( const char *, int, struct bench_result * ), const char *path, int nblocks, struct bench_result *r )
+/*
+Runs one phase in its own process, so each phase starts with an unmounted filesystem.
+*/
+{
+	int status;
+	pid_t pid;
+
+	fflush(stdout);
+	pid = fork();
+	if(pid<0) return 0;
+	if(pid==0) {
+		_exit(phase(path,nblocks,r) ? 0 : 1);
+	}
+	if(waitpid(pid,&status,0)<0) return 0;
+	return WIFEXITED(status) && WEXITSTATUS(status)==0;
+}
+
+int main( int argc, char *argv[] )
+{
+	const char *outname = "/dev/stdout";
+	const char *dir = ".";
+	char path[4096];
+	struct bench_result *r;
+	FILE *out;
+	int c, i, m;
+
+	while((c=getopt(argc,argv,"czq:s:o:d:"))!=-1) {
+		switch(c) {
+			case 'c': features |= FS_FEATURE_CHECKSUM; break;
+			case 'z': compress = 1; break;
+			case 'q': depth = atoi(optarg); break;
+			case 's': members = atoi(optarg); break;
+			case 'o': outname = optarg; break;
+			case 'd': dir = optarg; break;
+			default:
+				printf("use: %s [-c] [-z] [-q depth] [-s members] [-o outfile] [-d imagedir] <nblocks> ...\n",argv[0]);
+				return 1;
+		}
+	}
+	if(depth<0 || depth>BENCH_MAX_DEPTH) {
+		printf("the queue depth must be between 0 and %d\n",BENCH_MAX_DEPTH);
+		return 1;
+	}
+	if(members<1 || members>BENCH_MAX_MEMBERS) {
+		printf("the number of members must be between 1 and %d\n",BENCH_MAX_MEMBERS);
+		return 1;
+	}
+	if(optind>=argc) {
+		printf("use: %s [-c] [-z] [-q depth] [-s members] [-o outfile] [-d imagedir] <nblocks> ...\n",argv[0]);
+		return 1;
+	}
+
+	out = fopen(outname,"a");
+	if(!out) {
+		printf("couldn't open %s: %s\n",outname,strerror(errno));
+		return 1;
+	}
+
+	r = mmap(0,sizeof(*r),PROT_READ|PROT_WRITE,MAP_SHARED|MAP_ANONYMOUS,-1,0);
+	if(r==MAP_FAILED) {
+		printf("couldn't map result area: %s\n",strerror(errno));
+		return 1;
+	}
+
+	for(i=optind;i<argc;i++) {
+		int nblocks = atoi(argv[i]);
+
+		if(members==1) {
+			snprintf(path,sizeof(path),"%s/bench.%d.img",dir,nblocks);
+		} else {
+			path[0] = 0;
+			for(m=0;m<members;m++) {
+				int len = strlen(path);
+				snprintf(path+len,sizeof(path)-len,"%s%s/bench.%d.%d.img",m ? "," : "",dir,nblocks,m);
+			}
+		}
+		memset(r,0,sizeof(*r));
+
+		r->ok = run_child(bench_populate,path,nblocks,r) && run_child(bench_remount,path,nblocks,r);
+		for(m=0;m<members;m++) {
+			char member[4096];
+			if(members==1) {
+				snprintf(member,sizeof(member),"%s/bench.%d.img",dir,nblocks);
+			} else {
+				snprintf(member,sizeof(member),"%s/bench.%d.%d.img",dir,nblocks,m);
+			}
+			unlink(member);
+		}
+
+		fprintf(out,"{\"nblocks\":%d,\"image_bytes\":%lld,\"checksums\":%s,\"compressed\":%s,\"ok\":%s,\"files\":%d,\"file_bytes\":%lld,"
+			"\"format_ms\":%.3f,\"create_per_sec\":%.1f,"
+			"\"seq_write_MBps\":%.2f,\"seq_read_MBps\":%.2f,\"rand_write_MBps\":%.2f,\"rand_read_MBps\":%.2f,"
+			"\"queue_depth\":%d,\"async_read_MBps\":%.2f,\"members\":%d,"
+			"\"mount_ms\":%.3f,\"delete_ms\":%.3f,\"delete_per_sec\":%.1f}\n",
+			nblocks,(long long)nblocks*DISK_BLOCK_SIZE,features&FS_FEATURE_CHECKSUM ? "true" : "false",compress ? "true" : "false",r->ok ? "true" : "false",r->files,r->file_bytes,
+			r->format_ms,r->create_per_sec,
+			r->seq_write_MBps,r->seq_read_MBps,r->rand_write_MBps,r->rand_read_MBps,
+			depth,r->async_read_MBps,members,
+			r->mount_ms,r->delete_ms,r->delete_per_sec);
+		fflush(out);
+	}
+
+	fclose(out);
+	return 0;
+}
@@ -0,0 +1,155 @@
+#include "lz.h"
+
+#include <string.h>
+#include <stdint.h>
+
+#define LZ_HASH_BITS   12
+#define LZ_MIN_MATCH   4
+#define LZ_MAX_OFFSET  65535
+#define LZ_LAST_LITERALS 5
+
+static uint32_t read32( const unsigned char *p )
+{
+	uint32_t v;
+	memcpy(&v,p,4);
+	return v;
+}
+
+static int hash32( uint32_t v )
+{
+	return (v*2654435761u) >> (32-LZ_HASH_BITS);
+}
+
+static unsigned char *put_length( unsigned char *op, unsigned char *oend, int length )
+/*
+Writes the part of a length that did not fit in its four bit token field.
+*/
+{
+	while(length>=255) {
+		if(op>=oend) return 0;
+		*op++ = 255;
+		length -= 255;
+	}
+	if(op>=oend) return 0;
+	*op++ = length;
+	return op;
+}
+
+static unsigned char *put_sequence( unsigned char *op, unsigned char *oend, const unsigned char *literals, int nliterals, int offset, int matchlen )
+{
+	unsigned char *token = op++;
+	int ml = matchlen ? matchlen-LZ_MIN_MATCH : 0;
+
+	if(op>oend) return 0;
+	*token = (nliterals>=15 ? 15 : nliterals)<<4 | (ml>=15 ? 15 : ml);
+	if(nliterals>=15 && !(op=put_length(op,oend,nliterals-15))) return 0;
+	if(op+nliterals>oend) return 0;
+	memcpy(op,literals,nliterals);
+	op += nliterals;
+	if(!matchlen) return op;
+
+	if(op+2>oend) return 0;
+	*op++ = offset&0xff;
+	*op++ = offset>>8;
+	if(ml>=15 && !(op=put_length(op,oend,ml-15))) return 0;
+	return op;
+}
+
+int lz_compress( const char *in, int inlen, char *out, int outcap )
+/*
+Compresses inlen bytes into out.  Returns the compressed length, or zero if the result
+would not fit in outcap bytes.
+*/
+{
+	const unsigned char *ip = (const unsigned char *)in;
+	const unsigned char *iend = ip + inlen;
+	const unsigned char *anchor = ip;
+	const unsigned char *mflimit = iend - LZ_LAST_LITERALS;
+	unsigned char *op = (unsigned char *)out;
+	unsigned char *oend = op + outcap;
+	int table[1<<LZ_HASH_BITS];
+
+	memset(table,-1,sizeof(table));
+
+	while(inlen>LZ_LAST_LITERALS+LZ_MIN_MATCH && ip<mflimit-LZ_MIN_MATCH) {
+		uint32_t seq = read32(ip);
+		int h = hash32(seq);
+		int candidate = table[h];
+		table[h] = ip - (const unsigned char *)in;
+
+		if(candidate<0 || (ip-(const unsigned char *)in)-candidate>LZ_MAX_OFFSET || read32((const unsigned char *)in+candidate)!=seq) {
+			ip++;
+			continue;
+		}
+
+		const unsigned char *match = (const unsigned char *)in + candidate;
+		int matchlen = LZ_MIN_MATCH;
+		while(ip+matchlen<mflimit && ip[matchlen]==match[matchlen]) matchlen++;
+
+		op = put_sequence(op,oend,anchor,ip-anchor,ip-match,matchlen);
+		if(!op) return 0;
+
+		ip += matchlen;
+		anchor = ip;
+	}
+
+	op = put_sequence(op,oend,anchor,iend-anchor,0,0);
+	if(!op) return 0;
+	return op - (unsigned char *)out;
+}
+
+static const unsigned char *get_length( const unsigned char *ip, const unsigned char *iend, int *length )
+{
+	int b;
+	do {
+		if(ip>=iend) return 0;
+		b = *ip++;
+		*length += b;
+	} while(b==255);
+	return ip;
+}
+
+int lz_decompress( const char *in, int inlen, char *out, int outcap )
+/*
+Decompresses inlen bytes into out.  Returns the decompressed length, or -1 if the input is
+malformed or would overflow outcap bytes.
+*/
+{
+	const unsigned char *ip = (const unsigned char *)in;
+	const unsigned char *iend = ip + inlen;
+	unsigned char *op = (unsigned char *)out;
+	unsigned char *oend = op + outcap;
+
+	while(ip<iend) {
+		int token = *ip++;
+		int nliterals = token>>4;
+		int matchlen = token&15;
+
+		if(nliterals==15 && !(ip=get_length(ip,iend,&nliterals))) return -1;
+		if(ip+nliterals>iend || op+nliterals>oend) return -1;
+		memcpy(op,ip,nliterals);
+		ip += nliterals;
+		op += nliterals;
+
+		// The final sequence carries literals only
+		if(ip>=iend) break;
+
+		if(ip+2>iend) return -1;
+		int offset = ip[0] | ip[1]<<8;
+		ip += 2;
+		if(matchlen==15 && !(ip=get_length(ip,iend,&matchlen))) return -1;
+		matchlen += LZ_MIN_MATCH;
+
+		if(offset==0 || offset>op-(unsigned char *)out || op+matchlen>oend) return -1;
+
+		// A match that overlaps the bytes it produces has to be copied a byte at a time
+		const unsigned char *match = op - offset;
+		if(offset>=matchlen) {
+			memcpy(op,match,matchlen);
+			op += matchlen;
+		} else {
+			while(matchlen--) *op++ = *match++;
+		}
+	}
+	return op - (unsigned char *)out;
+}
@@ -0,0 +1,13 @@
+#ifndef LZ_H
+#define LZ_H
+
+/*
+A small LZ77 codec in the style of LZ4: a stream of sequences, each a token byte holding a
+literal count and a match length, the literals, and a two byte match offset.  It favors
+speed over ratio and needs no state beyond a stack-allocated hash table.
+*/
+
+int lz_compress( const char *in, int inlen, char *out, int outcap );
+int lz_decompress( const char *in, int inlen, char *out, int outcap );
+
+#endif
@@ -0,0 +1,142 @@
+/*
+Replays a block I/O trace recorded by disk_trace_start() against a disk image.
+Reads are issued as recorded; writes store a fixed pattern, since traces do not
+carry block contents, so replay against a scratch copy of the image.
+*/
+
+#include "disk.h"
+#include "trace.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+
+static const char *caller_names[TRACE_NCALLERS] = {
+	"none",
+	"fs_format",
+	"fs_mount",
+	"fs_create",
+	"fs_delete",
+	"fs_read",
+	"fs_write",
+	"other",
+};
+
+static long long now_ns()
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC,&ts);
+	return (long long)ts.tv_sec*1000000000LL + ts.tv_nsec;
+}
+
+static void sleep_until( long long deadline )
+{
+	long long delay = deadline - now_ns();
+	struct timespec ts;
+
+	if(delay<=0) return;
+	ts.tv_sec = delay / 1000000000LL;
+	ts.tv_nsec = delay % 1000000000LL;
+	nanosleep(&ts,0);
+}
+
+int main( int argc, char *argv[] )
+{
+	struct trace_header header;
+	struct trace_record *records;
+	long count, capacity, i, skipped=0;
+	long calls[TRACE_NCALLERS][2];
+	char data[DISK_BLOCK_SIZE];
+	FILE *file;
+	int timed = 0;
+
+	if(argc<4 || argc>5 || (argc==5 && strcmp(argv[4],"timed") && strcmp(argv[4],"fast"))) {
+		printf("use: %s <tracefile> <diskfile> <nblocks> [fast|timed]\n",argv[0]);
+		return 1;
+	}
+	if(argc==5) timed = !strcmp(argv[4],"timed");
+
+	file = fopen(argv[1],"r");
+	if(!file) {
+		printf("couldn't open %s: %s\n",argv[1],strerror(errno));
+		return 1;
+	}
+
+	if(fread(&header,sizeof(header),1,file)!=1 || memcmp(header.magic,TRACE_MAGIC,sizeof(header.magic)) || header.version!=TRACE_VERSION) {
+		printf("%s is not a simplefs trace\n",argv[1]);
+		fclose(file);
+		return 1;
+	}
+
+	// Load the whole trace up front so file reads do not disturb the replay
+	capacity = 4096;
+	count = 0;
+	records = malloc(capacity*sizeof(*records));
+	while(records) {
+		if(count==capacity) {
+			capacity *= 2;
+			records = realloc(records,capacity*sizeof(*records));
+			if(!records) break;
+		}
+		if(fread(&records[count],sizeof(*records),1,file)!=1) break;
+		count++;
+	}
+	fclose(file);
+
+	if(!records) {
+		printf("out of memory loading %s\n",argv[1]);
+		return 1;
+	}
+
+	if(!disk_init(argv[2],atoi(argv[3]))) {
+		printf("couldn't initialize %s: %s\n",argv[2],strerror(errno));
+		return 1;
+	}
+
+	printf("replaying %ld records recorded on a %u block disk against %s with %d blocks (%s)\n",
+		count,header.nblocks,argv[2],disk_size(),timed ? "timed" : "fast");
+
+	memset(calls,0,sizeof(calls));
+	memset(data,0xa5,sizeof(data));
+
+	long long start = now_ns();
+	for(i=0;i<count;i++) {
+		struct trace_record *r = &records[i];
+
+		if(r->blocknum>=(uint32_t)disk_size() || r->op>TRACE_OP_WRITE) {
+			skipped++;
+			continue;
+		}
+		if(timed) sleep_until(start + (long long)r->timestamp_ns);
+
+		if(r->op==TRACE_OP_READ) {
+			disk_read(r->blocknum,data);
+		} else {
+			disk_write(r->blocknum,data);
+		}
+		calls[r->caller<TRACE_NCALLERS ? r->caller : TRACE_CALLER_OTHER][r->op]++;
+	}
+	long long elapsed = now_ns() - start;
+
+	long long recorded = count ? (long long)records[count-1].timestamp_ns : 0;
+	double seconds = elapsed / 1e9;
+
+	printf("%ld records replayed, %ld skipped\n",count-skipped,skipped);
+	for(i=0;i<TRACE_NCALLERS;i++) {
+		if(calls[i][0] || calls[i][1]) {
+			printf("    %-10s %8ld reads %8ld writes\n",caller_names[i],calls[i][0],calls[i][1]);
+		}
+	}
+	printf("recorded duration %.6f s\n",recorded/1e9);
+	printf("replay duration   %.6f s\n",seconds);
+	if(seconds>0) {
+		printf("%.0f blocks/s, %.2f MB/s\n",(count-skipped)/seconds,(count-skipped)*(double)DISK_BLOCK_SIZE/seconds/1e6);
+	}
+
+	free(records);
+	disk_close();
+
+	return 0;
+}
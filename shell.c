@@ -1,25 +1,35 @@
 
 #include "fs.h"
 #include "disk.h"
+#include "stats.h"
 
 #include <stdio.h>
 #include <stdlib.h>
 #include <errno.h>
 #include <string.h>
+#include <signal.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/socket.h>
+#include <sys/un.h>
 
-static int do_copyin( const char *filename, int inumber );
-static int do_copyout( int inumber, const char *filename );
+static int run_command( char *line, FILE *in, FILE *out );
+static int do_copyin( const char *filename, int inumber, FILE *out );
+static int do_copyout( int inumber, const char *filename, FILE *out );
+static int copyin_stream( FILE *file, int length, int inumber, FILE *out );
+static int copyout_stream( int inumber, FILE *file );
+static int do_stats( int json, const char *filename, FILE *out );
+static int do_report( const char *filename, FILE *out );
+static int format_feature( const char *name );
+static int serve_copyout( const char *line, FILE *out );
+static int serve( const char *path );
 
 int main( int argc, char *argv[] )
 {
 	char line[1024];
-	char cmd[1024];
-	char arg1[1024];
-	char arg2[1024];
-	int inumber, result, args;
 
-	if(argc!=3) {
-		printf("use: %s <diskfile> <nblocks>\n",argv[0]);
+	if(argc!=3 && argc!=4) {
+		printf("use: %s <diskfile>[,<diskfile>...] <nblocks> [socket]\n",argv[0]);
 		return 1;
 	}
 
@@ -30,199 +40,620 @@ int main( int argc, char *argv[] )
 
 	printf("opened emulated disk image %s with %d blocks\n",argv[1],disk_size());
 
+	if(argc==4) {
+		return serve(argv[3]);
+	}
+
 	while(1) {
 		printf(" simplefs> ");
 		fflush(stdout);
 
 		if(!fgets(line,sizeof(line),stdin)) break;
+		if(!run_command(line,stdin,stdout)) break;
+	}
 
-		if(line[0]=='\n') continue;
-		line[strlen(line)-1] = 0;
+	printf("closing emulated disk.\n");
+	disk_close();
 
-		args = sscanf(line,"%s %s %s",cmd,arg1,arg2);
-		if(args==0) continue;
+	return 0;
+}
 
-		if(!strcmp(cmd,"format")) {
-			if(args==1) {
-				if(fs_format()) {
-					printf("disk formatted.\n");
-				} else {
-					printf("format failed!\n");
-				}
+static int run_command( char *line, FILE *in, FILE *out )
+/*
+Carries out one command line, writing its output to out.  A command that carries a payload,
+"copyin - <inumber> <length>", reads it from in.  Returns zero if the command asks to quit.
+*/
+{
+	char cmd[1024];
+	char arg1[1024];
+	char arg2[1024];
+	char arg3[1024];
+	int inumber, result, args;
+
+	if(line[0]=='\n') return 1;
+	if(line[strlen(line)-1]=='\n') line[strlen(line)-1] = 0;
+
+	args = sscanf(line,"%s %s %s %s",cmd,arg1,arg2,arg3);
+	if(args<=0) return 1;
+
+	if(!strcmp(cmd,"format")) {
+		int features = 0;
+		if(args>=2) features |= format_feature(arg1);
+		if(args>=3) features |= format_feature(arg2);
+		if(features>=0) {
+			if(fs_format_features(features)) {
+				fprintf(out,"disk formatted.\n");
 			} else {
-				printf("use: format\n");
+				fprintf(out,"format failed!\n");
 			}
-		} else if(!strcmp(cmd,"mount")) {
-			if(args==1) {
-				if(fs_mount()) {
-					printf("disk mounted.\n");
-				} else {
-					printf("mount failed!\n");
-				}
+		} else {
+			fprintf(out,"use: format [checksum] [dedup|reflink]\n");
+		}
+	} else if(!strcmp(cmd,"mount")) {
+		if(args==1) {
+			if(fs_mount()) {
+				fprintf(out,"disk mounted.\n");
 			} else {
-				printf("use: mount\n");
+				fprintf(out,"mount failed!\n");
 			}
-		} else if(!strcmp(cmd,"debug")) {
-			if(args==1) {
-				fs_debug();
+		} else {
+			fprintf(out,"use: mount\n");
+		}
+	} else if(!strcmp(cmd,"debug")) {
+		if(args==1) {
+			fs_debug();
+		} else {
+			fprintf(out,"use: debug\n");
+		}
+	} else if(!strcmp(cmd,"report")) {
+		if(args==1) {
+			if(!fs_report(out)) {
+				fprintf(out,"report failed!\n");
+			}
+		} else if(args==2) {
+			if(!do_report(arg1,out)) {
+				fprintf(out,"report failed!\n");
+			}
+		} else {
+			fprintf(out,"use: report [file]\n");
+		}
+	} else if(!strcmp(cmd,"fsck")) {
+		if(args==1 || (args==2 && !strcmp(arg1,"repair"))) {
+			result = fs_fsck(args==2);
+			if(result<0) {
+				fprintf(out,"fsck failed!\n");
+			} else if(result==0) {
+				fprintf(out,"filesystem is clean.\n");
 			} else {
-				printf("use: debug\n");
+				fprintf(out,"%d problems %s.\n",result,args==2 ? "repaired" : "found");
 			}
-		} else if(!strcmp(cmd,"getsize")) {
-			if(args==2) {
-				inumber = atoi(arg1);
-				result = fs_getsize(inumber);
-				if(result>=0) {
-					printf("inode %d has size %d\n",inumber,result);
-				} else {
-					printf("getsize failed!\n");
-				}
+		} else {
+			fprintf(out,"use: fsck [repair]\n");
+		}
+	} else if(!strcmp(cmd,"defrag")) {
+		if(args==1 || args==2) {
+			result = fs_defrag(args==2 ? atoi(arg1) : 0);
+			if(result>=0) {
+				fprintf(out,"%d files moved.\n",result);
 			} else {
-				printf("use: getsize <inumber>\n");
+				fprintf(out,"defrag failed!\n");
 			}
-			
-		} else if(!strcmp(cmd,"create")) {
-			if(args==1) {
-				inumber = fs_create();
-				if(inumber>0) {
-					printf("created inode %d\n",inumber);
-				} else {
-					printf("create failed!\n");
-				}
+		} else {
+			fprintf(out,"use: defrag [inumber]\n");
+		}
+	} else if(!strcmp(cmd,"stats")) {
+		if(args==1) {
+			stats_print(out,0);
+		} else if(args==2 && !strcmp(arg1,"on")) {
+			stats_enable(1);
+			fprintf(out,"statistics enabled.\n");
+		} else if(args==2 && !strcmp(arg1,"off")) {
+			stats_enable(0);
+			fprintf(out,"statistics disabled.\n");
+		} else if(args==2 && !strcmp(arg1,"reset")) {
+			stats_reset();
+			fprintf(out,"statistics reset.\n");
+		} else if(args==2 && (!strcmp(arg1,"text") || !strcmp(arg1,"json"))) {
+			stats_print(out,!strcmp(arg1,"json"));
+		} else if(args==3 && (!strcmp(arg1,"text") || !strcmp(arg1,"json"))) {
+			if(!do_stats(!strcmp(arg1,"json"),arg2,out)) {
+				fprintf(out,"stats failed!\n");
+			}
+		} else {
+			fprintf(out,"use: stats [on|off|reset|text|json] [file]\n");
+		}
+	} else if(!strcmp(cmd,"trace")) {
+		if(args==3 && !strcmp(arg1,"start")) {
+			if(disk_trace_start(arg2)) {
+				fprintf(out,"tracing block I/O to %s\n",arg2);
+			} else {
+				fprintf(out,"couldn't open %s: %s\n",arg2,strerror(errno));
+			}
+		} else if(args==2 && !strcmp(arg1,"stop")) {
+			disk_trace_stop();
+			fprintf(out,"trace stopped.\n");
+		} else {
+			fprintf(out,"use: trace start <file> | trace stop\n");
+		}
+	} else if(!strcmp(cmd,"getsize")) {
+		if(args==2) {
+			inumber = atoi(arg1);
+			result = fs_getsize(inumber);
+			if(result>=0) {
+				fprintf(out,"inode %d has size %d\n",inumber,result);
 			} else {
-				printf("use: create\n");
+				fprintf(out,"getsize failed!\n");
 			}
-		} else if(!strcmp(cmd,"delete")) {
-			if(args==2) {
-				inumber = atoi(arg1);
-				if(fs_delete(inumber)) {
-					printf("inode %d deleted.\n",inumber);
+		} else {
+			fprintf(out,"use: getsize <inumber>\n");
+		}
+		
+	} else if(!strcmp(cmd,"create")) {
+		if(args==1) {
+			inumber = fs_create();
+			if(inumber>0) {
+				fprintf(out,"created inode %d\n",inumber);
+			} else {
+				fprintf(out,"create failed!\n");
+			}
+		} else if(args==2 && atoi(arg1)>0) {
+			int count = atoi(arg1);
+			int *inumbers = malloc(sizeof(int)*count);
+			if(inumbers) {
+				result = fs_create_many(count,inumbers);
+				if(result>0) {
+					fprintf(out,"created %d inodes, %d to %d\n",result,inumbers[0],inumbers[result-1]);
 				} else {
-					printf("delete failed!\n");	
+					fprintf(out,"create failed!\n");
 				}
+				free(inumbers);
 			} else {
-				printf("use: delete <inumber>\n");
+				fprintf(out,"create failed!\n");
 			}
-		} else if(!strcmp(cmd,"cat")) {
-			if(args==2) {
-				inumber = atoi(arg1);
-				if(!do_copyout(inumber,"/dev/stdout")) {
-					printf("cat failed!\n");
-				}
+		} else {
+			fprintf(out,"use: create [count]\n");
+		}
+	} else if(!strcmp(cmd,"delete")) {
+		if(args==2) {
+			inumber = atoi(arg1);
+			if(fs_delete(inumber)) {
+				fprintf(out,"inode %d deleted.\n",inumber);
 			} else {
-				printf("use: cat <inumber>\n");
+				fprintf(out,"delete failed!\n");	
 			}
+		} else {
+			fprintf(out,"use: delete <inumber>\n");
+		}
+	} else if(!strcmp(cmd,"truncate")) {
+		if(args==3) {
+			inumber = atoi(arg1);
+			if(fs_truncate(inumber,atoi(arg2))) {
+				fprintf(out,"inode %d truncated to %d bytes.\n",inumber,atoi(arg2));
+			} else {
+				fprintf(out,"truncate failed!\n");
+			}
+		} else {
+			fprintf(out,"use: truncate <inumber> <size>\n");
+		}
+	} else if(!strcmp(cmd,"clone")) {
+		if(args==2) {
+			inumber = fs_clone(atoi(arg1));
+			if(inumber>0) {
+				fprintf(out,"cloned inode %d to inode %d\n",atoi(arg1),inumber);
+			} else {
+				fprintf(out,"clone failed!\n");
+			}
+		} else {
+			fprintf(out,"use: clone <inumber>\n");
+		}
+	} else if(!strcmp(cmd,"compress")) {
+		if(args==2 || (args==3 && !strcmp(arg2,"off"))) {
+			inumber = atoi(arg1);
+			if(fs_compress(inumber,args==2)) {
+				fprintf(out,"compression %s for inode %d.\n",args==2 ? "enabled" : "disabled",inumber);
+			} else {
+				fprintf(out,"compress failed!\n");
+			}
+		} else {
+			fprintf(out,"use: compress <inumber> [off]\n");
+		}
+	} else if(!strcmp(cmd,"cat")) {
+		if(args==2) {
+			inumber = atoi(arg1);
+			result = copyout_stream(inumber,out);
+			fprintf(out,"%d bytes copied\n",result);
+		} else {
+			fprintf(out,"use: cat <inumber>\n");
+		}
 
-		} else if(!strcmp(cmd,"copyin")) {
-			if(args==3) {
-				inumber = atoi(arg2);
-				if(do_copyin(arg1,inumber)) {
-					printf("copied file %s to inode %d\n",arg1,inumber);
-				} else {
-					printf("copy failed!\n");
-				}
+	} else if(!strcmp(cmd,"copyin")) {
+		if(args==3) {
+			inumber = atoi(arg2);
+			if(do_copyin(arg1,inumber,out)) {
+				fprintf(out,"copied file %s to inode %d\n",arg1,inumber);
+			} else {
+				fprintf(out,"copy failed!\n");
+			}
+		} else if(args==4 && !strcmp(arg1,"-") && atoi(arg3)>=0) {
+			inumber = atoi(arg2);
+			if(copyin_stream(in,atoi(arg3),inumber,out)) {
+				fprintf(out,"copied %d bytes to inode %d\n",atoi(arg3),inumber);
+			} else {
+				fprintf(out,"copy failed!\n");
+			}
+		} else {
+			fprintf(out,"use: copyin <filename> <inumber> | copyin - <inumber> <length>\n");
+		}
+
+	} else if(!strcmp(cmd,"copyout")) {
+		if(args==3 && !strcmp(arg2,"-")) {
+			copyout_stream(atoi(arg1),out);
+		} else if(args==3) {
+			inumber = atoi(arg1);
+			if(do_copyout(inumber,arg2,out)) {
+				fprintf(out,"copied inode %d to file %s\n",inumber,arg2);
 			} else {
-				printf("use: copyin <filename> <inumber>\n");
+				fprintf(out,"copy failed!\n");
 			}
+		} else {
+			fprintf(out,"use: copyout <inumber> <filename>\n");
+		}
 
-		} else if(!strcmp(cmd,"copyout")) {
-			if(args==3) {
-				inumber = atoi(arg1);
-				if(do_copyout(inumber,arg2)) {
-					printf("copied inode %d to file %s\n",inumber,arg2);
-				} else {
-					printf("copy failed!\n");
-				}
+	} else if(!strcmp(cmd,"lookup")) {
+		if(args==2) {
+			inumber = fs_lookup(arg1);
+			if(inumber>0) {
+				fprintf(out,"%s is inode %d\n",arg1,inumber);
 			} else {
-				printf("use: copyout <inumber> <filename>\n");
-			}
-
-		} else if(!strcmp(cmd,"help")) {
-			printf("Commands are:\n");
-			printf("    format\n");
-			printf("    mount\n");
-			printf("    debug\n");
-			printf("    create\n");
-			printf("    delete  <inode>\n");
-			printf("    cat     <inode>\n");
-			printf("    copyin  <file> <inode>\n");
-			printf("    copyout <inode> <file>\n");
-			printf("    help\n");
-			printf("    quit\n");
-			printf("    exit\n");
-		} else if(!strcmp(cmd,"quit")) {
-			break;
-		} else if(!strcmp(cmd,"exit")) {
-			break;
+				fprintf(out,"lookup failed!\n");
+			}
 		} else {
-			printf("unknown command: %s\n",cmd);
-			printf("type 'help' for a list of commands.\n");
-			result = 1;
+			fprintf(out,"use: lookup <name>\n");
 		}
-	}
 
-	printf("closing emulated disk.\n");
-	disk_close();
+	} else if(!strcmp(cmd,"link")) {
+		if(args==3) {
+			inumber = atoi(arg2);
+			if(fs_link(arg1,inumber)) {
+				fprintf(out,"linked %s to inode %d\n",arg1,inumber);
+			} else {
+				fprintf(out,"link failed!\n");
+			}
+		} else {
+			fprintf(out,"use: link <name> <inumber>\n");
+		}
 
-	return 0;
+	} else if(!strcmp(cmd,"unlink")) {
+		if(args==2) {
+			if(fs_unlink(arg1)) {
+				fprintf(out,"%s unlinked.\n",arg1);
+			} else {
+				fprintf(out,"unlink failed!\n");
+			}
+		} else {
+			fprintf(out,"use: unlink <name>\n");
+		}
+
+	} else if(!strcmp(cmd,"help")) {
+		fprintf(out,"Commands are:\n");
+		fprintf(out,"    format  [checksum] [dedup|reflink]\n");
+		fprintf(out,"    mount\n");
+		fprintf(out,"    debug\n");
+		fprintf(out,"    report  [file]\n");
+		fprintf(out,"    fsck    [repair]\n");
+		fprintf(out,"    defrag  [inode]\n");
+		fprintf(out,"    stats   [on|off|reset|text|json] [file]\n");
+		fprintf(out,"    trace   start <file> | stop\n");
+		fprintf(out,"    create  [count]\n");
+		fprintf(out,"    delete  <inode>\n");
+		fprintf(out,"    truncate <inode> <size>\n");
+		fprintf(out,"    clone   <inode>\n");
+		fprintf(out,"    compress <inode> [off]\n");
+		fprintf(out,"    cat     <inode>\n");
+		fprintf(out,"    copyin  <file> <inode> | - <inode> <length>\n");
+		fprintf(out,"    copyout <inode> <file> | -\n");
+		fprintf(out,"    lookup  <name>\n");
+		fprintf(out,"    link    <name> <inode>\n");
+		fprintf(out,"    unlink  <name>\n");
+		fprintf(out,"    help\n");
+		fprintf(out,"    quit\n");
+		fprintf(out,"    exit\n");
+	} else if(!strcmp(cmd,"quit")) {
+		return 0;
+	} else if(!strcmp(cmd,"exit")) {
+		return 0;
+	} else {
+		fprintf(out,"unknown command: %s\n",cmd);
+		fprintf(out,"type 'help' for a list of commands.\n");
+	}
+	return 1;
 }
 
-static int do_copyin( const char *filename, int inumber )
+static int do_copyin( const char *filename, int inumber, FILE *out )
 {
 	FILE *file;
-	int offset=0, result, actual;
-	char buffer[16384];
+	int result;
 
 	file = fopen(filename,"r");
 	if(!file) {
-		printf("couldn't open %s: %s\n",filename,strerror(errno));
+		fprintf(out,"couldn't open %s: %s\n",filename,strerror(errno));
 		return 0;
 	}
 
-	while(1) {
-		result = fread(buffer,1,sizeof(buffer),file);
+	result = copyin_stream(file,-1,inumber,out);
+
+	fclose(file);
+	return result;
+}
+
+static int copyin_stream( FILE *file, int length, int inumber, FILE *out )
+/*
+Copies length bytes from file into the inode, or everything up to the end of the file if
+length is negative.  If the filesystem stops short, the rest of the bytes are still read and
+thrown away, so that a payload sent by a client never runs into its next command.
+*/
+{
+	int offset=0, consumed=0, result, actual;
+	char buffer[16384];
+
+	while(length<0 || consumed<length) {
+		int want = length<0 || length-consumed>(int)sizeof(buffer) ? (int)sizeof(buffer) : length-consumed;
+		result = fread(buffer,1,want,file);
 		if(result<=0) break;
+		consumed += result;
 		if(result>0) {
 			actual = fs_write(inumber,buffer,result,offset);
 			if(actual<0) {
-				printf("ERROR: fs_write return invalid result %d\n",actual);
+				fprintf(out,"ERROR: fs_write return invalid result %d\n",actual);
 				break;
 			}
 			offset += actual;
 			if(actual!=result) {
-				printf("WARNING: fs_write only wrote %d bytes, not %d bytes\n",actual,result);
+				fprintf(out,"WARNING: fs_write only wrote %d bytes, not %d bytes\n",actual,result);
 				break;
 			}
 		}
 	}
 
-	printf("%d bytes copied\n",offset);
+	fprintf(out,"%d bytes copied\n",offset);
 
-	fclose(file);
-	return 1;
+	while(length>=0 && consumed<length) {
+		int want = length-consumed>(int)sizeof(buffer) ? (int)sizeof(buffer) : length-consumed;
+		result = fread(buffer,1,want,file);
+		if(result<=0) break;
+		consumed += result;
+	}
+	return length<0 || offset==length;
 }
 
-static int do_copyout( int inumber, const char *filename )
+static int do_copyout( int inumber, const char *filename, FILE *out )
 {
 	FILE *file;
-	int offset=0, result;
-	char buffer[16384];
+	int offset;
 
 	file = fopen(filename,"w");
 	if(!file) {
-		printf("couldn't open %s: %s\n",filename,strerror(errno));
+		fprintf(out,"couldn't open %s: %s\n",filename,strerror(errno));
 		return 0;
 	}
 
+	offset = copyout_stream(inumber,file);
+
+	fprintf(out,"%d bytes copied\n",offset);
+
+	fclose(file);
+	return 1;
+}
+
+static int copyout_stream( int inumber, FILE *file )
+/*
+Writes the whole inode to file and returns the number of bytes copied.
+*/
+{
+	int offset=0, result;
+	char buffer[16384];
+
 	while(1) {
 		result = fs_read(inumber,buffer,sizeof(buffer),offset);
 		if(result<=0) break;
 		fwrite(buffer,1,result,file);
 		offset += result;
 	}
+	return offset;
+}
 
-	printf("%d bytes copied\n",offset);
+static int do_stats( int json, const char *filename, FILE *out )
+{
+	FILE *file;
+
+	file = fopen(filename,"w");
+	if(!file) {
+		fprintf(out,"couldn't open %s: %s\n",filename,strerror(errno));
+		return 0;
+	}
+
+	stats_print(file,json);
 
 	fclose(file);
 	return 1;
 }
+
+static int do_report( const char *filename, FILE *out )
+{
+	FILE *file;
+	int result;
+
+	file = fopen(filename,"w");
+	if(!file) {
+		fprintf(out,"couldn't open %s: %s\n",filename,strerror(errno));
+		return 0;
+	}
+
+	result = fs_report(file);
+
+	if(fclose(file)!=0) result = 0;
+	return result;
+}
+
+static int format_feature( const char *name )
+/*
+Maps a format option to its feature bit, or -1 if there is no such option.
+*/
+{
+	if(!strcmp(name,"checksum")) return FS_FEATURE_CHECKSUM;
+	if(!strcmp(name,"dedup")) return FS_FEATURE_DEDUP;
+	if(!strcmp(name,"reflink")) return FS_FEATURE_REFLINK;
+	return -1;
+}
+
+static int serve_copyout( const char *line, FILE *out )
+/*
+Sends the reply to "copyout <inumber> -" straight from the filesystem a chunk at a time,
+rather than building it in memory first like every other reply.  The length sent ahead of
+it is the file's size when the copy starts; should another client shrink the file while it
+is being sent, the rest goes out as zeros so the reply still has that length.  A file that
+does not exist gets the shell's usual "copy failed!" reply.  Returns zero, having sent
+nothing, if line is any other command, and -1 if a read fails partway through, in which case
+the reply is cut short and the caller should hang up so that the client notices.
+*/
+{
+	char cmd[1024], arg1[1024], arg2[1024], arg3[1024];
+	char buffer[16384];
+	int inumber, size, offset=0, result;
+
+	if(sscanf(line,"%s %s %s %s",cmd,arg1,arg2,arg3)!=3 || strcmp(cmd,"copyout") || strcmp(arg2,"-")) return 0;
+
+	inumber = atoi(arg1);
+	size = fs_getsize(inumber);
+	if(size<0) {
+		fprintf(out,"%d\ncopy failed!\n",(int)strlen("copy failed!\n"));
+		fflush(out);
+		return 1;
+	}
+
+	fprintf(out,"%d\n",size);
+	while(offset<size) {
+		int want = size-offset>(int)sizeof(buffer) ? (int)sizeof(buffer) : size-offset;
+		result = fs_read(inumber,buffer,want,offset);
+		if(result<=0) {
+			int now = fs_getsize(inumber);
+			if(now<0 || now>offset) {
+				fflush(out);
+				return -1;
+			}
+			memset(buffer,0,want);
+			result = want;
+		}
+		if(fwrite(buffer,1,result,out)!=(size_t)result) break;
+		offset += result;
+	}
+	fflush(out);
+	return 1;
+}
+
+static void *serve_client( void *arg )
+/*
+Runs the commands of one client connection until it quits or hangs up.
+*/
+{
+	int fd = (long)arg;
+	FILE *in = fdopen(fd,"r");
+	FILE *out = fdopen(dup(fd),"w");
+	char line[1024];
+	char *reply;
+	size_t length;
+	int more = 1, streamed;
+
+	if(!in || !out) {
+		if(in) fclose(in); else close(fd);
+		if(out) fclose(out);
+		return 0;
+	}
+
+	while(more && fgets(line,sizeof(line),in)) {
+		streamed = serve_copyout(line,out);
+		if(streamed<0) break;
+		if(streamed) continue;
+
+		FILE *buffer = open_memstream(&reply,&length);
+		if(!buffer) break;
+		more = run_command(line,in,buffer);
+		fclose(buffer);
+
+		fprintf(out,"%zu\n",length);
+		fwrite(reply,1,length,out);
+		fflush(out);
+		free(reply);
+	}
+
+	fclose(in);
+	fclose(out);
+	return 0;
+}
+
+static int serve( const char *path )
+/*
+Runs as a daemon serving the shell's commands to local clients over a Unix domain socket at
+path.  The filesystem is mounted once here, if the disk holds one, and stays mounted, with
+its bitmaps and indexes in memory, for as long as the daemon runs.  Each connection gets its
+own thread, and the filesystem lets their commands run side by side.
+
+A client writes command lines exactly as typed at the prompt, and may send any number of
+them before reading a reply.  Every command gets exactly one reply, in order: the byte
+length of its output in decimal on a line of its own, then the output itself.  The payload
+of "copyin - <inumber> <length>" follows its command line directly, and "copyout <inumber> -"
+replies with the raw contents of the file, streamed rather than held in memory; if a block
+cannot be read partway through, the daemon hangs up, leaving that reply short.  Diagnostics
+from inside the filesystem, and the output of debug, go to the daemon's own standard output.
+*/
+{
+	struct sockaddr_un address;
+	pthread_t thread;
+	int listener;
+
+	if(fs_mount()) {
+		printf("disk mounted.\n");
+	} else {
+		printf("no filesystem mounted yet, a client can format and mount one.\n");
+	}
+
+	if(strlen(path)>=sizeof(address.sun_path)) {
+		printf("socket path %s is too long\n",path);
+		return 1;
+	}
+	memset(&address,0,sizeof(address));
+	address.sun_family = AF_UNIX;
+	strcpy(address.sun_path,path);
+
+	listener = socket(AF_UNIX,SOCK_STREAM,0);
+	unlink(path);
+	if(listener<0 || bind(listener,(struct sockaddr *)&address,sizeof(address))<0 || listen(listener,64)<0) {
+		printf("couldn't listen on %s: %s\n",path,strerror(errno));
+		return 1;
+	}
+
+	// A client that hangs up mid-reply must not take the daemon down with it
+	signal(SIGPIPE,SIG_IGN);
+
+	printf("serving on %s\n",path);
+	fflush(stdout);
+
+	while(1) {
+		int fd = accept(listener,0,0);
+		if(fd<0) {
+			if(errno==EINTR || errno==ECONNABORTED) continue;
+			printf("couldn't accept a connection: %s\n",strerror(errno));
+			break;
+		}
+		if(pthread_create(&thread,0,serve_client,(void *)(long)fd)!=0) {
+			close(fd);
+			continue;
+		}
+		pthread_detach(thread);
+	}
+
+	close(listener);
+	unlink(path);
+	disk_close();
+	return 1;
+}
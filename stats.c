@@ -0,0 +1,141 @@
+#include "stats.h"
+#include "disk.h"
+
+#include <string.h>
+#include <time.h>
+
+#define STATS_BUCKETS 40
+
+struct stats_counters {
+	long long calls;
+	long long bytes;
+	long long blocks;
+	long long total_ns;
+	long long max_ns;
+	long long histogram[STATS_BUCKETS];
+};
+
+static const char *stats_names[STATS_NOPS] = {
+	"fs_mount",
+	"fs_create",
+	"fs_delete",
+	"fs_read",
+	"fs_write",
+	"fs_truncate",
+	"fs_lookup",
+	"fs_link",
+	"fs_unlink",
+	"disk_read",
+	"disk_write",
+};
+
+int stats_on = 0;
+
+static struct stats_counters counters[STATS_NOPS];
+
+// Physical blocks touched by the calling thread, so nested fs calls can see their own I/O
+static __thread long long thread_blocks = 0;
+
+static long long stats_now()
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC,&ts);
+	return (long long)ts.tv_sec*1000000000LL + ts.tv_nsec;
+}
+
+static int stats_bucket( long long ns )
+{
+	int b = 0;
+	while(ns>1 && b<STATS_BUCKETS-1) {
+		ns >>= 1;
+		b++;
+	}
+	return b;
+}
+
+void stats_enable( int on )
+{
+	stats_on = on;
+}
+
+void stats_reset()
+{
+	memset(counters,0,sizeof(counters));
+}
+
+void stats_begin_slow( struct stats_timer *t )
+{
+	t->start = stats_now();
+	t->blocks = thread_blocks;
+}
+
+void stats_end_slow( struct stats_timer *t, int op, long long bytes )
+{
+	struct stats_counters *c = &counters[op];
+	long long ns = stats_now() - t->start;
+	long long blocks;
+
+	if(op==STATS_DISK_READ || op==STATS_DISK_WRITE) {
+		blocks = bytes/DISK_BLOCK_SIZE;
+		thread_blocks += blocks;
+	} else {
+		blocks = thread_blocks - t->blocks;
+	}
+
+	__sync_fetch_and_add(&c->calls,1);
+	__sync_fetch_and_add(&c->bytes,bytes);
+	__sync_fetch_and_add(&c->blocks,blocks);
+	__sync_fetch_and_add(&c->total_ns,ns);
+	__sync_fetch_and_add(&c->histogram[stats_bucket(ns)],1);
+
+	long long max = c->max_ns;
+	while(ns>max) {
+		long long seen = __sync_val_compare_and_swap(&c->max_ns,max,ns);
+		if(seen==max) break;
+		max = seen;
+	}
+}
+
+void stats_print( FILE *file, int json )
+/*
+Writes every counter to file, either as a human readable table or as a single JSON object.
+Histogram buckets are labelled by their lower bound in nanoseconds; empty buckets are omitted.
+*/
+{
+	int i, b, first;
+
+	if(json) {
+		fprintf(file,"{\"enabled\":%s,\"ops\":{",stats_on ? "true" : "false");
+		for(i=0;i<STATS_NOPS;i++) {
+			struct stats_counters *c = &counters[i];
+			fprintf(file,"%s\"%s\":{\"calls\":%lld,\"bytes\":%lld,\"blocks\":%lld,\"total_ns\":%lld,\"max_ns\":%lld,\"latency_ns\":{",
+				i ? "," : "",stats_names[i],c->calls,c->bytes,c->blocks,c->total_ns,c->max_ns);
+			first = 1;
+			for(b=0;b<STATS_BUCKETS;b++) {
+				if(!c->histogram[b]) continue;
+				fprintf(file,"%s\"%lld\":%lld",first ? "" : ",",b ? 1LL<<b : 0LL,c->histogram[b]);
+				first = 0;
+			}
+			fprintf(file,"}}");
+		}
+		fprintf(file,"}}\n");
+		return;
+	}
+
+	fprintf(file,"statistics are %s\n",stats_on ? "enabled" : "disabled");
+	fprintf(file,"%-10s %10s %12s %10s %12s %12s\n","operation","calls","bytes","blocks","avg ns","max ns");
+	for(i=0;i<STATS_NOPS;i++) {
+		struct stats_counters *c = &counters[i];
+		fprintf(file,"%-10s %10lld %12lld %10lld %12lld %12lld\n",stats_names[i],c->calls,c->bytes,c->blocks,
+			c->calls ? c->total_ns/c->calls : 0,c->max_ns);
+	}
+	for(i=0;i<STATS_NOPS;i++) {
+		struct stats_counters *c = &counters[i];
+		if(!c->calls) continue;
+		fprintf(file,"%s latency:\n",stats_names[i]);
+		for(b=0;b<STATS_BUCKETS;b++) {
+			if(!c->histogram[b]) continue;
+			fprintf(file,"    >= %12lld ns: %lld\n",b ? 1LL<<b : 0LL,c->histogram[b]);
+		}
+	}
+}
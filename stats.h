@@ -0,0 +1,52 @@
+#ifndef STATS_H
+#define STATS_H
+
+#include <stdio.h>
+
+/*
+Per-operation instrumentation for the filesystem and disk layers.  Each operation keeps a
+call count, bytes moved, physical blocks touched and a histogram of latencies with one
+bucket per power of two nanoseconds.  Recording is off by default; when it is off
+stats_begin and stats_end cost one load and one branch.
+*/
+
+enum stats_op {
+	STATS_FS_MOUNT,
+	STATS_FS_CREATE,
+	STATS_FS_DELETE,
+	STATS_FS_READ,
+	STATS_FS_WRITE,
+	STATS_FS_TRUNCATE,
+	STATS_FS_LOOKUP,
+	STATS_FS_LINK,
+	STATS_FS_UNLINK,
+	STATS_DISK_READ,
+	STATS_DISK_WRITE,
+	STATS_NOPS
+};
+
+struct stats_timer {
+	long long start;
+	long long blocks;
+};
+
+extern int stats_on;
+
+void stats_enable( int on );
+void stats_reset();
+void stats_print( FILE *file, int json );
+
+void stats_begin_slow( struct stats_timer *t );
+void stats_end_slow( struct stats_timer *t, int op, long long bytes );
+
+static inline void stats_begin( struct stats_timer *t )
+{
+	if(stats_on) stats_begin_slow(t);
+}
+
+static inline void stats_end( struct stats_timer *t, int op, long long bytes )
+{
+	if(stats_on) stats_end_slow(t,op,bytes);
+}
+
+#endif
@@ -0,0 +1,274 @@
+#!/bin/bash
+# Physical I/O regression test.  Runs fixed operation scripts through simplefs and
+# compares the disk block read and write counts reported at close against the
+# baselines in test_io.expected.  Run "./test_io.sh update" to rewrite the baselines
+# after an intentional change in I/O behavior.
+uut="./simplefs"
+expected="test_io.expected"
+nblocks=2000
+bs=4096
+
+tmp=`mktemp -d`
+trap "rm -rf $tmp" EXIT
+
+# Input files of exactly 0, 1, 5 and 1029 blocks (the largest file an inode can hold)
+for n in 0 1 5 1029; do
+    head -c $((n*bs)) /dev/zero | tr '\0' 'a' > $tmp/in.$n
+done
+# And ones of 8 and 20 blocks that all differ
+seq 100000 | head -c $((8*bs)) > $tmp/in.seq
+seq 100000 | head -c $((20*bs)) > $tmp/in.seq20
+
+# Prints the I/O counts of one simplefs session run on the given image
+counts() {
+    local image=$1
+    $uut $image $nblocks | awk '/disk block reads/ {r=$1} /disk block writes/ {w=$1} END {print r, w}'
+}
+
+# Leaves a freshly formatted image at $1
+fresh() {
+    rm -f $1
+    printf 'format\n' | $uut $1 $nblocks > /dev/null
+}
+
+run() {
+    local name=$1 image=$2
+    echo "$name `counts $image`"
+}
+
+# Prints the free data block count of the image at $1
+free_blocks() {
+    printf 'mount\nreport\n' | $uut $1 $nblocks | grep -o '"free_blocks":[0-9]*' | cut -d: -f2
+}
+
+{
+    rm -f $tmp/img
+    run format $tmp/img <<< "format"
+
+    fresh $tmp/img
+    run mount_empty $tmp/img <<< "mount"
+
+    fresh $tmp/img
+    run create $tmp/img <<< $'mount\ncreate'
+
+    fresh $tmp/img
+    printf 'mount\ncreate\nlink first 1\n' | $uut $tmp/img $nblocks > /dev/null
+    run link $tmp/img <<< $'mount\nlink second 1'
+    run lookup $tmp/img <<< $'mount\nlookup first'
+    run unlink $tmp/img <<< $'mount\nunlink first'
+
+    # The directory's own inodes (2 is the root, 3 its bucket) refuse the per-inode calls
+    fresh $tmp/img
+    printf 'mount\ncreate\nlink first 1\n' | $uut $tmp/img $nblocks > /dev/null
+    out=`$uut $tmp/img $nblocks <<< "mount
+delete 2
+delete 3
+copyin $tmp/in.1 3
+truncate 3 0
+clone 3
+compress 2
+lookup first
+fsck"`
+    if [ `grep -c 'belongs to the root directory' <<< "$out"` != 6 ] ||
+       ! grep -q 'first is inode 1' <<< "$out" || ! grep -q 'filesystem is clean' <<< "$out"; then
+        echo "directory inodes were not protected"
+    fi
+
+    # A root inode that is no longer a directory fails the mount until fsck detaches it
+    cp $tmp/img $tmp/img.dir
+    printf '\0\0\0\0' | dd of=$tmp/img.dir bs=1 seek=$((bs+2*32)) conv=notrunc 2> /dev/null
+    out=`printf 'mount\nfsck repair\nmount\nfsck\nlink again 1\nlookup again\n' | $uut $tmp/img.dir $nblocks`
+    if ! grep -q 'mount failed' <<< "$out" || ! grep -q '1 problems repaired' <<< "$out" ||
+       ! grep -q 'filesystem is clean' <<< "$out" || ! grep -q 'again is inode 1' <<< "$out"; then
+        echo "a damaged root directory was not repaired"
+    fi
+
+    # A bucket with the wrong count is found and recounted
+    block=`printf 'mount\nreport\n' | $uut $tmp/img $nblocks | grep -o '"inumber":3,[^}]*' | sed 's/.*"extents":\[\[\([0-9]*\),.*/\1/'`
+    printf '\11' | dd of=$tmp/img bs=1 seek=$((block*bs+4)) conv=notrunc 2> /dev/null
+    out=`printf 'fsck\nfsck repair\nfsck\nmount\nlookup first\n' | $uut $tmp/img $nblocks`
+    if ! grep -q 'says it holds 9 names but holds 1' <<< "$out" || ! grep -q '1 problems repaired' <<< "$out" ||
+       ! grep -q 'filesystem is clean' <<< "$out" || ! grep -q 'first is inode 1' <<< "$out"; then
+        echo "a damaged directory bucket was not repaired"
+    fi
+
+    # Defrag refuses a file it cannot follow in full rather than moving other files over
+    # the blocks it can still reach, and runs once fsck has repaired it
+    fresh $tmp/img
+    printf "mount\ncreate 3\ncopyin $tmp/in.1 1\ncopyin $tmp/in.5 2\ncopyin $tmp/in.1 3\ndelete 1\n" | $uut $tmp/img $nblocks > /dev/null
+    printf '\237\206\1\0' | dd of=$tmp/img bs=1 seek=$((bs+2*32+8+4*4)) conv=notrunc 2> /dev/null
+    out=`$uut $tmp/img $nblocks <<< "mount
+defrag
+fsck repair
+defrag
+fsck
+copyout 2 $tmp/out.2
+copyout 3 $tmp/out.3"`
+    if ! grep -q 'inode 2 has invalid block pointers' <<< "$out" || ! grep -q 'defrag failed' <<< "$out" ||
+       ! grep -q 'filesystem is clean' <<< "$out" || ! cmp -s $tmp/in.1 $tmp/out.3 ||
+       ! cmp -s <(head -c $((4*bs)) $tmp/in.5) $tmp/out.2; then
+        echo "defrag moved blocks around a damaged file"
+    fi
+
+    # On a checksum disk, defrag leaves a file with a damaged block where it is rather than
+    # copying the damage under a fresh checksum, and still moves the files around it
+    rm -f $tmp/img
+    printf "format checksum\nmount\ncreate 3\ncopyin $tmp/in.1 1\ncopyin $tmp/in.5 2\ncopyin $tmp/in.1 3\ndelete 1\n" | $uut $tmp/img $nblocks > /dev/null
+    block=`printf 'mount\nreport\n' | $uut $tmp/img $nblocks | grep -o '"inumber":2,[^}]*' | sed 's/.*"extents":\[\[\([0-9]*\),.*/\1/'`
+    printf 'damaged!' | dd of=$tmp/img bs=1 seek=$((block*bs+100)) conv=notrunc 2> /dev/null
+    out=`$uut $tmp/img $nblocks <<< "mount
+defrag
+copyout 3 $tmp/out.3"`
+    after=`printf 'mount\nreport\n' | $uut $tmp/img $nblocks | grep -o '"inumber":2,[^}]*' | sed 's/.*"extents":\[\[\([0-9]*\),.*/\1/'`
+    again=`printf "mount\ncopyout 2 $tmp/out.2\n" | $uut $tmp/img $nblocks`
+    if ! grep -q 'inode 2 has a damaged block' <<< "$out" || grep -q 'defrag failed' <<< "$out" ||
+       [ "$block" != "$after" ] || ! cmp -s $tmp/in.1 $tmp/out.3 ||
+       ! grep -q "checksum mismatch on block $block" <<< "$again"; then
+        echo "defrag accepted a block that fails its checksum"
+    fi
+
+    # A second copy of a file on a dedup disk takes only its own indirect block, and each
+    # copy keeps its own contents once the other is overwritten or deleted
+    rm -f $tmp/img
+    printf 'format dedup\nmount\ncreate 2\n' | $uut $tmp/img $nblocks > /dev/null
+    run dedup_copyin $tmp/img <<< "mount
+copyin $tmp/in.seq 1"
+    before=`free_blocks $tmp/img`
+    run dedup_copyin_again $tmp/img <<< "mount
+copyin $tmp/in.seq 2"
+    after=`free_blocks $tmp/img`
+    run dedup_overwrite $tmp/img <<< "mount
+copyin $tmp/in.5 1"
+    run dedup_delete $tmp/img <<< $'mount\ndelete 2'
+    out=`$uut $tmp/img $nblocks <<< "mount
+fsck
+copyout 1 $tmp/out.dedup"`
+    if [ $((before - 1)) != "$after" ] || ! grep -q 'filesystem is clean' <<< "$out" ||
+       ! cmp -s <(cat $tmp/in.5; tail -c $((3*bs)) $tmp/in.seq) $tmp/out.dedup; then
+        echo "dedup lost or duplicated blocks"
+    fi
+
+    # A clone of a file bigger than the direct pointers shares its indirect block; writing
+    # to the clone leaves the source alone, and deleting the source leaves the clone whole
+    rm -f $tmp/img
+    printf "format reflink\nmount\ncreate\ncopyin $tmp/in.seq 1\n" | $uut $tmp/img $nblocks > /dev/null
+    run clone $tmp/img <<< $'mount\nclone 1'
+    run clone_write $tmp/img <<< "mount
+copyin $tmp/in.1 2"
+    out=`$uut $tmp/img $nblocks <<< "mount
+copyout 1 $tmp/out.source"`
+    run clone_delete_source $tmp/img <<< $'mount\ndelete 1'
+    out=`$uut $tmp/img $nblocks <<< "mount
+fsck
+copyout 2 $tmp/out.clone"`
+    if ! grep -q 'filesystem is clean' <<< "$out" || ! cmp -s $tmp/in.seq $tmp/out.source ||
+       ! cmp -s <(cat $tmp/in.1; tail -c $((7*bs)) $tmp/in.seq) $tmp/out.clone; then
+        echo "a clone and its source did not keep their own contents"
+    fi
+
+    # A compressed file survives a partial overwrite and truncates that end partway through
+    # a cluster and partway through a block
+    fresh $tmp/img
+    printf 'mount\ncreate\ncompress 1\n' | $uut $tmp/img $nblocks > /dev/null
+    run compressed_copyin $tmp/img <<< "mount
+copyin $tmp/in.seq20 1"
+    run compressed_overwrite $tmp/img <<< "mount
+copyin $tmp/in.1 1"
+    run compressed_truncate $tmp/img <<< "mount
+truncate 1 $((11*bs+100))"
+    run compressed_copyout $tmp/img <<< "mount
+copyout 1 $tmp/out.compressed"
+    cat $tmp/in.1 <(tail -c +$((bs+1)) $tmp/in.seq20) | head -c $((11*bs+100)) > $tmp/want.compressed
+    cmp -s $tmp/want.compressed $tmp/out.compressed || echo "compressed_copyout returned the wrong data"
+    out=`$uut $tmp/img $nblocks <<< "mount
+truncate 1 $((3*bs+7))
+fsck
+copyout 1 $tmp/out.compressed"`
+    if ! grep -q 'filesystem is clean' <<< "$out" ||
+       ! cmp -s <(head -c $((3*bs+7)) $tmp/want.compressed) $tmp/out.compressed; then
+        echo "a compressed file truncated inside its first cluster returned the wrong data"
+    fi
+
+    # Random reads checked as they complete through the async pool, with and without
+    # checksums, which the workers then compute side by side
+    for flag in "" -c; do
+        if ! ./asynctest $flag $tmp/img.async > $tmp/async.out; then
+            echo "asynctest $flag: `tail -1 $tmp/async.out`"
+        fi
+    done
+
+    # The daemon answers pipelined commands with length-prefixed replies, takes copyin
+    # payloads inline and streams copyout back
+    rm -f $tmp/img.serve
+    $uut $tmp/img.serve $nblocks $tmp/sock > $tmp/serve.out &
+    daemon=$!
+    for i in `seq 50`; do [ -S $tmp/sock ] && break; sleep 0.1; done
+    if ! python3 - $tmp/sock $tmp/in.1029 $tmp/in.seq20 > $tmp/client.out 2>&1 <<'CLIENT'
+import socket, sys
+
+s = socket.socket(socket.AF_UNIX)
+s.connect(sys.argv[1])
+f = s.makefile('rb')
+big, small = open(sys.argv[2], 'rb').read(), open(sys.argv[3], 'rb').read()
+
+def reply():
+    line = f.readline()
+    if not line.endswith(b'\n'):
+        sys.exit('reply has no length line')
+    data = f.read(int(line))
+    if len(data) != int(line):
+        sys.exit('reply is shorter than its length')
+    return data
+
+s.sendall(b'format\nmount\ncreate 2\n' +
+          b'copyin - 1 %d\n' % len(big) + big + b'copyin - 2 %d\n' % len(small) + small +
+          b'getsize 1\ncopyout 1 -\ncopyout 2 -\ncopyout 9 -\nbogus\nfsck\nquit\n')
+expected = [b'disk formatted.\n', b'disk mounted.\n', b'created 2 inodes, 1 to 2\n',
+            b'%d bytes copied\ncopied %d bytes to inode 1\n' % (len(big), len(big)),
+            b'%d bytes copied\ncopied %d bytes to inode 2\n' % (len(small), len(small)),
+            b'inode 1 has size %d\n' % len(big), big, small, b'copy failed!\n',
+            b'unknown command: bogus\ntype \'help\' for a list of commands.\n',
+            b'filesystem is clean.\n', b'']
+for i, want in enumerate(expected):
+    got = reply()
+    if got != want:
+        sys.exit('reply %d is %r' % (i + 1, got[:60]))
+if f.read(1):
+    sys.exit('the daemon sent more than one reply per command')
+CLIENT
+    then
+        echo "daemon: `tail -1 $tmp/client.out`"
+    fi
+    kill $daemon
+    wait $daemon 2> /dev/null
+
+    for n in 0 1 5 1029; do
+        fresh $tmp/img
+        printf 'mount\ncreate\n' | $uut $tmp/img $nblocks > /dev/null
+        run copyin_$n $tmp/img <<< "mount
+copyin $tmp/in.$n 1"
+        run copyout_$n $tmp/img <<< "mount
+copyout 1 $tmp/out.$n"
+        if ! cmp -s $tmp/in.$n $tmp/out.$n; then
+            echo "copyout_$n returned the wrong data"
+        fi
+        run mount_$n $tmp/img <<< "mount"
+        cp $tmp/img $tmp/img.half
+        run truncate_$n $tmp/img.half <<< "mount
+truncate 1 $((n*bs/2))"
+        run delete_$n $tmp/img <<< $'mount\ndelete 1'
+    done
+} > $tmp/actual
+
+if [ "$1" == "update" ]; then
+    cp $tmp/actual $expected
+    echo "updated $expected"
+    exit 0
+fi
+
+if diff -u $expected $tmp/actual; then
+    echo "I/O counts match $expected"
+else
+    echo "I/O counts differ from $expected (case reads writes)"
+    exit 1
+fi
@@ -0,0 +1,45 @@
+#ifndef TRACE_H
+#define TRACE_H
+
+#include <stdint.h>
+
+/*
+On-disk format of a block I/O trace.  A trace is a header followed by one fixed-size record
+per disk_read or disk_write, in the order the disk layer saw them.  All fields are stored in
+host byte order.
+*/
+
+#define TRACE_MAGIC   "SFSTRACE"
+#define TRACE_VERSION 1
+
+#define TRACE_OP_READ  0
+#define TRACE_OP_WRITE 1
+
+// Filesystem operation on whose behalf a block was transferred
+enum trace_caller {
+	TRACE_CALLER_NONE,
+	TRACE_CALLER_FORMAT,
+	TRACE_CALLER_MOUNT,
+	TRACE_CALLER_CREATE,
+	TRACE_CALLER_DELETE,
+	TRACE_CALLER_READ,
+	TRACE_CALLER_WRITE,
+	TRACE_CALLER_OTHER,
+	TRACE_NCALLERS
+};
+
+struct trace_header {
+	char     magic[8];
+	uint32_t version;
+	uint32_t nblocks;
+};
+
+struct trace_record {
+	uint64_t timestamp_ns;		// Time since the trace was started
+	uint32_t blocknum;
+	uint8_t  op;
+	uint8_t  caller;
+	uint16_t reserved;
+};
+
+#endif